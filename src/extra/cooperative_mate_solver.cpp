@@ -1,3 +1,8 @@
+// shogi.hでFILEがdefineされるので、<fstream>はそれより先にincludeしておく。
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
 #include "../shogi.h"
 #ifdef COOPERATIVE_MATE_SOLVER
 
@@ -11,41 +16,229 @@ using namespace Search;
 
 namespace CooperativeMate
 {
+  // --- 指し手の並べ替え
+
+  // 残り探索深さがこれ以上の局面では、指し手を並べ替える。0なら並べ替えない。CM_OrderDepthの値。
+  // 不詰めを証明する反復では全部の指し手を調べるので並べ替えても得がないが、
+  // 詰む深さの反復では詰み手順を早く見つけられる。残り探索深さが少ない局面では並べ替えの手間のほうが大きい。
+  uint32_t order_depth = 0;
+
+  // 指し手に安く求まる評価値を付ける。大きいほど良さそうな手。
+  // 先手(王手をかける側) : 後手の応手が少ない手、王手をかけた駒が玉に近い手、後手の駒を取る手ほど良い。
+  // 後手(王手を回避する側) : 先手の駒を取らない手、玉が盤の端に近づく手ほど良い。
+  // 後手の応手の数を数えるために1手進めるので、posは一時的に変更される。
+  // 先手の指し手はLEGAL_CHECKS_ALLで生成したもの(ExtMove::checkersに王手している駒が記録されている)であること。
+  void score_moves(Position& pos, ExtMove* begin, ExtMove* end)
+  {
+    const Color us = pos.side_to_move();
+    const Square ksq = pos.king_square(WHITE);
+    StateInfo si;
+
+    for (auto it = begin; it != end; ++it)
+    {
+      const Move m = it->move;
+      const Square to = move_to(m);
+      const bool capture = !is_drop(m) && pos.piece_on(to) != NO_PIECE;
+      int value;
+
+      if (us == BLACK)
+      {
+        pos.do_move(m, si, checkers_of(*it));
+        pos.check_info_update();
+        // 応手の数はcountMoves<LEGAL_EVASIONS_ALL>でも数えられるが、回避手は王手している駒と玉の逃げ場を
+        // 調べるのが大半で、指し手を書き出さなくても速くならない(test countmoves)ので、生成して数える。
+        const int n = (int)MoveList<LEGAL_EVASIONS_ALL>(pos).size();
+        pos.undo_move(m);
+
+        // 応手がなければ詰み(か打ち歩詰め)なので真っ先に調べる。
+        value = n == 0 ? 10000 : -n * 16 - dist(to, ksq) + (capture ? 8 : 0);
+      } else {
+        value = capture ? -16 : 0;
+        if (!is_drop(m) && move_from(m) == ksq)
+        {
+          int f = file_of(to), r = rank_of(to);
+          value -= std::min(std::min(f, 8 - f), std::min(r, 8 - r));
+        }
+      }
+      it->value = (Value)value;
+    }
+  }
+
+  // 評価値の大きい順に並べ替える。同じ評価値なら生成順を保つ。(指し手の数は少ないので挿入ソートで十分)
+  void sort_moves(ExtMove* begin, ExtMove* end)
+  {
+    for (auto p = begin + 1; p < end; ++p)
+    {
+      ExtMove tmp = *p, *q;
+      for (q = p; q != begin && (q - 1)->value < tmp.value; --q)
+        *q = *(q - 1);
+      *q = tmp;
+    }
+  }
+
+  // score_moves()の評価値で並べ替える。
+  void order_moves(Position& pos, ExtMove* begin, ExtMove* end)
+  {
+    score_moves(pos, begin, end);
+    sort_moves(begin, end);
+  }
+
+  // 探索中の指し手eで局面を進める。
+  // 先手の指し手はExtMove::checkersに王手している駒を記録してあるので(生成した指し手はLEGAL_CHECKS_ALLが、
+  // 置換表の指し手は指し手を詰めるときに求めておく)、それをdo_move()に渡して王手の判定をやり直さない。
+  // 後手の指し手は王手になることが稀なのでgives_check()で調べる。
+  inline void do_search_move(Position& pos, const ExtMove& e, StateInfo& si)
+  {
+    if (pos.side_to_move() == BLACK)
+      pos.do_move(e.move, si, checkers_of(e));
+    else
+      pos.do_move(e.move, si, pos.gives_check(e.move));
+  }
+
+  // 置換表の指し手mがこの局面で指せるなら、eに詰めてtrueを返す。
+  // 置換表はkeyの一部のbit(tag)でしか照合しないので、hash衝突で別の局面の指し手を引くことがある。
+  // legal()はpseudo_legalな指し手であることが前提なので、先にpseudo_legal()で調べる。
+  // 先手の指し手は王手でなければならない(打ち歩詰めも除く)。王手している駒はdo_move()に渡せるようにe.checkersに記録する。
+  bool tt_move_to(const Position& pos, Move m, ExtMove& e)
+  {
+    if (!pos.pseudo_legal(m) || !pos.legal(m))
+      return false;
+
+    e.move = m;
+    if (pos.side_to_move() == BLACK)
+    {
+      e.checkers = make_checkers(pos, m);
+      if (e.checkers == make_checkers(false, SQ_NB))
+        return false;
+      if (is_drop(m) && move_dropped_piece(m) == PAWN && !pos.legal_drop(move_to(m)))
+        return false;
+    }
+    return true;
+  }
+
+  // --- history , counter move
+
+  // 残り探索深さがこれ以上の局面では、前の反復までに生き残った(不詰めが確定しなかった)指し手を先に調べる。
+  // 0なら使わない。CM_HistoryDepthの値。
+  uint32_t history_depth = 0;
+
+  // historyの値の上限。更新するときに、上限に近いほど増えにくくする。
+  const int32_t HistoryMax = 1 << 14;
+
+  // counter moveに加える評価値
+  const int32_t CounterMoveBonus = HistoryMax / 8;
+
+  // スレッドごとのhistory。反復深化の間で引き継ぐ。
+  struct History
+  {
+    // [手番][移動元(駒打ちなら打った駒)][移動先]
+    int32_t table[COLOR_NB][128][SQ_NB];
+
+    // [手番][直前の指し手の移動先] → その局面で最後に生き残った指し手
+    Move counter[COLOR_NB][SQ_NB];
+
+    void clear()
+    {
+      memset(table, 0, sizeof(table));
+      for (auto& c : counter)
+        for (auto& m : c)
+          m = MOVE_NONE;
+    }
+
+    // 反復ごとに半分にして、古い反復の結果ほど効かなくする。
+    void age()
+    {
+      for (auto& c : table)
+        for (auto& f : c)
+          for (auto& v : f)
+            v /= 2;
+    }
+
+    int32_t& at(Color us, Move m) { return table[us][move_from(m)][move_to(m)]; }
+
+    // 指し手mで進めた局面の探索結果で更新する。survived = 不詰めが確定しなかった。
+    void update(Color us, Move prev, Move m, bool survived, uint32_t depth)
+    {
+      int32_t bonus = (int32_t)std::min(depth * depth, 1024u);
+      if (!survived)
+        bonus = -bonus;
+      auto& h = at(us, m);
+      h += bonus - h * std::abs(bonus) / HistoryMax;
+      if (survived && prev != MOVE_NONE)
+        counter[us][move_to(prev)] = m;
+    }
+
+    // historyの値をExtMove.valueに加える。prevは直前の指し手。
+    void add_scores(Color us, Move prev, ExtMove* begin, ExtMove* end)
+    {
+      const Move cm = prev != MOVE_NONE ? counter[us][move_to(prev)] : MOVE_NONE;
+      for (auto it = begin; it != end; ++it)
+        it->value = (Value)(it->value + at(us, it->move) / 8 + (it->move == cm ? CounterMoveBonus / 8 : 0));
+    }
+  };
+
+  thread_local std::unique_ptr<History> history;
+
+  History& thread_history()
+  {
+    if (!history)
+    {
+      history.reset(new History);
+      history->clear();
+    }
+    return *history;
+  }
+
+  // 探索開始時と各反復の開始時に呼び出す。
+  void history_new_iteration(bool first)
+  {
+    if (!history_depth)
+      return;
+    if (first)
+      thread_history().clear();
+    else
+      thread_history().age();
+  }
+
   // 協力詰め用のMovePicker
   struct MovePicker
   {
     // ttMove = 置換表の指し手
-    MovePicker(const Position& pos_, Move ttMove) : pos(pos_)
+    // depth = 残り探索深さ。order_depth以上なら指し手を並べ替える。
+    MovePicker(Position& pos_, Move ttMove, uint32_t depth = 0) : pos(pos_)
     {
       if (ttMove == MOVE_NONE)
       {
         // 協力詰めであれば段階的に指し手を生成する必要はない。
-        // 先手ならば王手の指し手(CHECKS)、後手ならば回避手(EVASIONS)を生成。
-        endMoves = (pos.side_to_move() == BLACK) ? generateMoves<CHECKS_ALL>(pos, currentMoves)
-          : generateMoves<EVASIONS_ALL>(pos, currentMoves);
-      } else {
+        // 先手ならば合法な王手の指し手(LEGAL_CHECKS)、後手ならば合法な回避手(LEGAL_EVASIONS)を生成。
+        // どちらも自殺手を含まないので、legal()で調べる必要はない。
+        endMoves = (pos.side_to_move() == BLACK) ? generateMoves<LEGAL_CHECKS_ALL>(pos, currentMoves)
+          : generateMoves<LEGAL_EVASIONS_ALL>(pos, currentMoves);
+        if (order_depth && depth >= order_depth)
+          order_moves(pos_, currentMoves, endMoves);
+      } else if (tt_move_to(pos, ttMove, *currentMoves)) {
         // 置換表に載っていた指し手が一つしかないのはone replyなのでこれで指し手生成をはしょれる。
-        *currentMoves = ttMove;
         endMoves++;
       }
     }
 
-    // 次の指し手をひとつ返す
+    // 次の合法手をひとつ返す
     // 指し手が尽きればMOVE_NONEが返る。
     Move next_move() {
-      if (currentMoves == endMoves)
-        return MOVE_NONE;
-      return *currentMoves++;
+      return currentMoves != endMoves ? (currentMoves++)->move : MOVE_NONE;
     }
 
+    // next_move()で最後に返した指し手で局面を進める。
+    void do_move(StateInfo& si) { do_search_move(pos, *(currentMoves - 1), si); }
+
   private:
-    const Position& pos;
+    Position& pos;
 
     ExtMove moves[MAX_MOVES], *currentMoves = moves, *endMoves = moves;
 
   };
 
-  TranspositionTable TT;
+  TranspositionTable<TTCluster> TT;
 
   // 現在、詰まないとわかっている探索深さ
   std::atomic<uint32_t> search_depth;
@@ -56,70 +249,480 @@ namespace CooperativeMate
   // このスレッドの反復深化の深さ
   thread_local uint32_t id_depth_thread = 0;
 
-  // 協力詰め
+  // 各スレッドの反復深化の深さ。checkpointに記録するためのもの。
+  // Threadsの上限が128なので、その数だけ用意しておく。
+  std::atomic<uint32_t> id_depth[128];
+
+  // 反復深化を開始する深さ。checkpointから再開したときは1より深くなる。
+  // search_depthは探索中に他のスレッドが更新するので、探索開始時に決めておく。
+  uint32_t start_depth = 1;
+
+  // 見つけた詰み手順(開始局面から)。batchで結果を書き出すのに使う。
+  std::string solution;
+
+  // 不詰めが証明できたか
+  std::atomic<bool> nomate_proven;
+
+  // 列挙する解の数。CM_Solutionsの値。1なら最初の解を見つけた時点で終了する。0なら全部数える。
+  int max_solutions = 1;
+
+  // 最初に見つけた解の手数
+  uint32_t solution_length = 0;
+
+  // 置換表のsave_mate()のentryをrootからたどって、length手の詰み手順を復元する。
+  // 途中でentryが見つからなかったり、length手で後手が詰んでいなかったりしたら空の文字列を返す。
+  std::string mate_line(Position& pos, uint32_t length)
+  {
+    std::unique_ptr<StateInfo[]> si(new StateInfo[length]);
+    std::vector<Move> moves;
+    while (moves.size() < length)
+    {
+      Move m = TT.probe_mate(TT.key(pos));
+      pos.check_info_update();
+      if (m == MOVE_NONE || !pos.pseudo_legal(m) || !pos.legal(m))
+        break;
+      pos.do_move(m, si[moves.size()], pos.gives_check(m));
+      moves.push_back(m);
+    }
+
+    bool mated = moves.size() == length && pos.side_to_move() == WHITE && pos.is_mated();
+
+    for (auto it = moves.rbegin(); it != moves.rend(); ++it)
+      pos.undo_move(*it);
+
+    if (!mated)
+      return "";
+
+    std::stringstream ss;
+    for (auto m : moves)
+      ss << m << ' ';
+    return ss.str();
+  }
+
+  // --- 循環局面
+
+  // 探索中の手順(探索開始局面から現在の局面まで)に現れた局面の集合。スレッドごとに持つ。
+  // 同じ局面が手順上に2度現れたら、2度目の局面は1度目の局面より残り探索深さが少ないので、
+  // そこから詰むなら1度目の局面からもっと短く詰む。よって2度目の局面は探索しなくて良い。
+  //
+  // ただし、その結果は一般には手順に依存する。(graph history interaction)
+  // 1度目の局面Pをi手目、2度目をj手目、反復深化の深さをDとする。
+  // D未満の詰みがないことが証明済み(D <= search_depth + 2)なら、Pからの詰みはD-i手以上なので、
+  // j手目のP(残りD-j手)からは詰まず、枝刈りは手順によらず正しい。途中の局面の不詰めも置換表に記録して良い。
+  // 他のスレッドより先の深さを探索しているとき(D > search_depth + 2)はそうとは限らないので、
+  // 循環で枝刈りした結果に依存する局面の不詰めは置換表に記録しない。1度目の局面自身は記録して良い。
+  //
+  // keyはlong_key()の64bit。open addressing(linear probing)で、手順に局面を足すのと除くのが定数時間でできる。
+  struct PathSet
+  {
+    PathSet() { resize(1024); }
+
+    // 局面を手順に加える。plyは探索開始局面からの手数。
+    void insert(Key key, uint32_t ply)
+    {
+      if ((count + 1) * 2 > table.size())
+        resize(table.size() * 2);
+      size_t i = home(key);
+      while (table[i].ply != EMPTY)
+        i = (i + 1) & mask;
+      table[i].key = key;
+      table[i].ply = ply;
+      ++count;
+    }
+
+    // 局面が手順上にあれば、その手数をplyに入れてtrueを返す。
+    bool find(Key key, uint32_t& ply) const
+    {
+      for (size_t i = home(key); table[i].ply != EMPTY; i = (i + 1) & mask)
+        if (table[i].key == key)
+        {
+          ply = table[i].ply;
+          return true;
+        }
+      return false;
+    }
+
+    // 局面を手順から取り除く。後ろのentryを詰めて、probeの連鎖が途切れないようにする。
+    void erase(Key key)
+    {
+      size_t i = home(key);
+      while (table[i].key != key || table[i].ply == EMPTY)
+        i = (i + 1) & mask;
+
+      for (size_t j = (i + 1) & mask; table[j].ply != EMPTY; j = (j + 1) & mask)
+      {
+        // jのentryの本来の位置hが(i,j]の範囲になければ、iに移せる。
+        size_t h = home(table[j].key);
+        if (i < j ? (h <= i || h > j) : (h <= i && h > j))
+        {
+          table[i] = table[j];
+          i = j;
+        }
+      }
+      table[i].ply = EMPTY;
+      --count;
+    }
+
+  private:
+    static const uint32_t EMPTY = UINT32_MAX;
+
+    struct Entry
+    {
+      Key key;
+      uint32_t ply;
+    };
+
+    // bit0は手番なので使わない。
+    size_t home(Key key) const { return (size_t)(key >> 1) & mask; }
+
+    void resize(size_t size)
+    {
+      std::vector<Entry> old;
+      old.swap(table);
+      table.assign(size, Entry{ 0, EMPTY });
+      mask = size - 1;
+      count = 0;
+      for (auto& e : old)
+        if (e.ply != EMPTY)
+          insert(e.key, e.ply);
+    }
+
+    std::vector<Entry> table;
+    size_t mask;
+    size_t count;
+  };
+
+  thread_local PathSet path_set;
+
+  // 循環による枝刈りに依存した結果を置換表に記録して良いか。(PathSetのコメントを参照)
+  inline bool cycle_cut_exact()
+  {
+    return id_depth_thread <= search_depth + 2;
+  }
+
+  // まだ確定できない詰み手順の候補。
+  // search_depth+2より長い詰みは、それより短い詰みがまだ見つかるかも知れないので確定できない。
+  // 見つけたスレッドは候補として登録したら待たずに次の深さの探索に移り、
+  // search_depthが進んで候補より短い詰みがないことが証明された時点で、search_depthを進めたスレッドが確定させる。
+  // 確定できるのは一番短い候補だけなので、それだけを持っておく。
+  std::mutex candidate_mutex;
+  std::vector<Move> candidate;
+
+  // candidateの手数。候補がなければMAX_PLY。
+  std::atomic<uint32_t> candidate_length(MAX_PLY);
+
+  // 詰み手順を確定させる。確定させたスレッドだけtrueが返る。
+  bool claim_mate(uint32_t length)
+  {
+    // 同時に確定させようとしたスレッドがあっても、確定させるのは1つだけ。
+    bool expected = false;
+    if (!mate_found.compare_exchange_strong(expected, true))
+      return false;
+    solution_length = length;
+    return true;
+  }
+
+  // 候補より短い詰みがないことが証明されていれば、候補を確定させて出力する。
+  // 候補を登録したときと、search_depthを進めたときに呼び出す。
+  void release_candidate()
+  {
+    if (candidate_length == MAX_PLY || search_depth + 2 < candidate_length)
+      return;
+
+    std::unique_lock<std::mutex> lk(candidate_mutex);
+    if (!claim_mate(candidate_length))
+      return;
+
+    std::stringstream ss;
+    for (auto m : candidate)
+      ss << m << ' ';
+    solution = ss.str();
+
+    // 別解を列挙するときは、列挙し終わってからfinalize()で出力する。
+    if (max_solutions == 1)
+      sync_cout << "checkmate " << solution << sync_endl;
+  }
+
+  // 探索開始局面からlength手で後手が詰んだ局面に到達したときに呼び出す。
+  // 現在詰まないことが判明している探索深さ(search_depth)+2の長さの詰みであれば、このスレッドの詰みとして確定させてtrueを返す。
+  // それより長い詰みなら、他のスレッドがもっと短い詰みを見つけるかも知れないので、path(詰みまでの指し手)を候補として登録してfalseを返す。
+  // 候補を登録したスレッドは、search_aborted()によってその深さの探索を打ち切る。
+  template <typename PathBuilder>
+  bool commit_mate(uint32_t length, PathBuilder path)
+  {
+    if (search_depth + 2 >= length)
+      return claim_mate(length);
+
+    {
+      std::unique_lock<std::mutex> lk(candidate_mutex);
+      if (length < candidate_length)
+      {
+        candidate = path();
+        candidate_length = length;
+      }
+    }
+
+    // 登録している間にsearch_depthが進んでいたときのために。
+    release_candidate();
+    return false;
+  }
+
+  // --- 探索の予算(時間・ノード数・置換表の使用率)
+
+  // 予算。0なら制限なし。init()でLimitsとCM_HashfullLimitから設定する。
+  int64_t time_budget = 0;  // [ms] "go mate <ms>"か"go movetime <ms>"
+  int64_t node_budget = 0;  // "go nodes <n>"
+  int hashfull_budget = 0;  // 置換表の使用率[‰] (現在の世代のentryの割合。TT.hashfull()と同じ)
+
+  // 探索を開始した時刻
+  TimePoint search_start_time;
+
+  // 予算を使い切って停止したか
+  std::atomic<bool> budget_exceeded;
+
+  // 予算を調べる間隔(各スレッドの局面数)。
+  // nodes_searched()は全スレッドのnodesを足し合わせるので、局面ごとに調べると探索が遅くなる。
+  const uint32_t LimitCheckInterval = 4096;
+
+  thread_local uint32_t limit_check_count = 0;
+
+  // 予算を使い切っていたらSignals.stopで全スレッドを停止させる。
+  void check_limits()
+  {
+    if (budget_exceeded)
+      return;
+
+    if ((time_budget && now() - search_start_time >= time_budget)
+      || (node_budget && (int64_t)Threads.nodes_searched() >= node_budget)
+      || (hashfull_budget && TT.hashfull() >= hashfull_budget))
+    {
+      budget_exceeded = true;
+      Signals.stop = true;
+    }
+  }
+
+  // 探索の各局面で呼び出す。LimitCheckInterval局面ごとにcheck_limits()する。
+  inline void poll_limits()
+  {
+    if (++limit_check_count >= LimitCheckInterval)
+    {
+      limit_check_count = 0;
+      check_limits();
+    }
+  }
+
+  // 探索を打ち切るか。
+  // 停止したときと詰みが見つかったときのほかに、このスレッドの反復深化の深さ以上で詰まないことが
+  // 他のスレッドによって証明されたときと、この深さ以下の詰み手順の候補が登録されたときも、
+  // この深さの探索を続ける意味がないので打ち切る。
+  inline bool search_aborted()
+  {
+    return Signals.stop || mate_found || id_depth_thread <= search_depth || id_depth_thread >= candidate_length;
+  }
+
+  // --- 末端の局面の詰み判定
+
+  // 残り探索深さ1(1手詰め)の局面をleaf_mate1()で調べ、王手をかけた局面の詰みをPosition::has_legal_evasion()で判定する。
+  // また、王手が1つもない先手番の局面は、Position::has_legal_check()で指し手を生成する前に打ち切る。
+  // 残り探索深さ3の局面は、子の詰みの判定と孫の1手詰めの判定がこれらで済むので、3手詰めもほぼbitboardの判定だけで調べられる。
+  // falseなら、従来通り王手をすべてdo_move()してis_mated()で判定する。(比較用) CM_LeafSolverの値。
+  bool leaf_solver = true;
+
+  // 手番側が詰んでいるか。(pos.is_mated()の代わり)
+  inline bool mated(const Position& pos)
+  {
+    return (leaf_solver && pos.in_check()) ? !pos.has_legal_evasion() : pos.is_mated();
+  }
+
+  // 先手の指し手mで後手玉が詰む可能性があるか。falseなら詰まないことが確定している。
+  // do_move()せずに、mのあとの後手玉の逃げ場所がすべて先手の駒の利きに入るかを調べる。
+  // 利きはmで動かした駒が元の升にも残っているものとして求めるので、本当の利きより多く見積もっている。
+  // よって、ここで利いていない逃げ場所は本当に逃げられる。
+  bool may_mate(const Position& pos, Move m)
+  {
+    const Square ksq = pos.king_square(WHITE);
+    const Square to = move_to(m);
+    Bitboard occ = pos.pieces() ^ ksq;
+    Piece pc;
+    if (is_drop(m))
+      pc = move_dropped_piece(m);
+    else
+    {
+      const Square from = move_from(m);
+      pc = (Piece)(pos.piece_on(from) + (is_promote(m) ? PIECE_PROMOTE : 0));
+      occ ^= from;
+    }
+    occ |= to;
+
+    // 後手の駒を取ったなら、玉はその升にも逃げられる。
+    Bitboard escape = kingEffect(ksq) & ~(pos.pieces(WHITE) & ~Bitboard(to)) & ~effects_from(pc, to, occ);
+
+#ifdef MATE_1PLY
+    // 指す前の局面で先手の利きがない升は、fromを空けて延びる長い利きがなければ、指したあとも利きがない。
+    const bool extended = !is_drop(m) && pos.long_effect_of(BLACK).directions(move_from(m));
+#endif
+    while (escape)
+    {
+      const Square sq = escape.pop();
+#ifdef MATE_1PLY
+      if (!extended && !pos.board_effect(BLACK).count(sq))
+        return false;
+#endif
+      if (!pos.attackers_to(BLACK, sq, occ))
+        return false;
+    }
+    return true;
+  }
+
+  // 残り探索深さ1の先手番の局面で、後手玉を詰ませる王手を探す。見つかればその指し手を、なければMOVE_NONEを返す。
+  // 詰まなかったときは、replyCountに合法な王手の数、oneReplyに最後の合法な王手が返る。
+  // ttMove = 置換表の指し手。あればそれだけを調べる。(MovePickerと同じ)
+  // (再帰版のsearch()でdepth == 1のときの指し手のループと同じ結果)
+  Move leaf_mate1(Position& pos, Move ttMove, int& replyCount, Move& oneReply)
+  {
+    ExtMove moves[MAX_MOVES], *last = moves;
+    StateInfo si;
+    replyCount = 0;
+    oneReply = MOVE_NONE;
+
+    pos.check_info_update();
+
+#ifdef MATE_1PLY
+    // 近接王手による1手詰めは、王手を生成せずに利きの数から見つけられる。(見つからなくても詰まないとは限らない)
+    Move mate = pos.mate1ply();
+    if (mate != MOVE_NONE)
+      return mate;
+#endif
+
+    // 生成した王手は合法手で、王手している駒も記録されている。置換表の指し手は調べる必要がある。
+    if (ttMove == MOVE_NONE)
+      last = generateMoves<LEGAL_CHECKS_ALL>(pos, moves);
+    else if (tt_move_to(pos, ttMove, *last))
+      ++last;
+
+    for (auto it = moves; it != last; ++it)
+    {
+      const Move m = it->move;
+      if (may_mate(pos, m))
+      {
+        pos.do_move(m, si, checkers_of(*it));
+        const bool mate = !pos.has_legal_evasion();
+        pos.undo_move(m);
+        if (mate)
+          return m;
+      }
+      replyCount++;
+      oneReply = m;
+    }
+    return MOVE_NONE;
+  }
+
+  // 協力詰め(再帰版)
+  // 探索の定義としてはこちらが基準。反復深化で使うのは非再帰版のsearch_nonrecursive()のほう。
   // depth = 残り探索深さ
-  // no_mate_depth = この局面は、この深さの残り探索深さがあっても詰まない(あるいは詰みを発見して出力済み)
-  void search(Position& pos, uint32_t depth, int& no_mate_depth)
+  // no_mate_depth = この局面は、この深さの残り探索深さがあっても詰まない
+  // cycle_ply = この局面の結果が、手順上のこの手数の局面との循環による枝刈りに依存している。依存していなければMAX_PLY。
+  // 戻り値 = この局面が、このスレッドが見つけた詰み手順上にあるか。
+  //  そのときは置換表にsave_mate()で詰みに至る指し手を記録してあるので、探索終了後にmate_line()で手順を復元できる。
+  bool search(Position& pos, uint32_t depth, int& no_mate_depth, uint32_t& cycle_ply)
   {
+    poll_limits();
+    cycle_ply = MAX_PLY;
+
     // 強制停止
-    if (Signals.stop || mate_found)
+    if (search_aborted())
     {
       no_mate_depth = MAX_PLY;
-      return;
+      return false;
+    }
+
+    // 循環局面なら、残り探索深さdepthでは詰まないものとして扱う。(1度目の局面で調べるので)
+    // 言えるのは残りdepth手で詰まないことだけなので、MAX_PLY(いくら深さがあっても詰まない)にはしない。
+    // MAX_PLYにすると、親が「どの深さでも詰まない」と置換表に記録したり、この指し手を応手の数に数えずに
+    // 残りの1手だけを置換表の指し手として記録したりしてしまう。
+    // 再帰版は探索開始局面から反復深化の深さ(id_depth_thread)で呼び出すので、そこからの手数は深さの差。
+    const uint32_t ply = id_depth_thread - depth;
+    const Key path_key = pos.state()->long_key();
+    if (path_set.find(path_key, cycle_ply))
+    {
+      no_mate_depth = depth;
+      return false;
     }
 
-    Key128 key = pos.state()->long_key();
+    auto key = TT.key(pos);
     Move tt_move;
     // 置換表がヒットするか
     if (TT.probe(key, depth, tt_move))
     {
       no_mate_depth = depth; // foundのときにdepthはTTEntry.depth()で書き換わっている。
-      return;
+      return false;
       // このnodeに関しては現在の残り探索深さ以上の深さにおいて
       //不詰めが証明されているのでもう帰ってよい。(枝刈り)
     }
 
+    // 残り1手なら1手詰めを調べるだけ。
+    if (leaf_solver && depth == 1 && pos.side_to_move() == BLACK)
+    {
+      int replyCount;
+      Move oneReply;
+      Move m = leaf_mate1(pos, tt_move, replyCount, oneReply);
+      no_mate_depth = replyCount ? 1 : MAX_PLY;
+      if (m != MOVE_NONE)
+      {
+        no_mate_depth = MAX_PLY;
+        if (!claim_mate(ply + 1))
+          return false;
+        TT.save_mate(key, m);
+        return true;
+      }
+      if (!search_aborted())
+        TT.save(key, no_mate_depth, replyCount == 1 ? oneReply : MOVE_NONE);
+      return false;
+    }
+
+    path_set.insert(path_key, ply);
+
     StateInfo si;
     pos.check_info_update(); // legal()とgives_check()とCHECKSの指し手生成に先だって呼び出されている必要がある。
 
-    MovePicker mp(pos, tt_move);
+    // 王手が1つもなければ、残り探索深さがいくらあっても詰まない。MovePickerで指し手を生成する前に調べる。
+    if (leaf_solver && pos.side_to_move() == BLACK && tt_move == MOVE_NONE && !pos.has_legal_check())
+    {
+      path_set.erase(path_key);
+      no_mate_depth = MAX_PLY;
+      TT.save(key, MAX_PLY, MOVE_NONE);
+      return false;
+    }
+
+    MovePicker mp(pos, tt_move, depth);
     Move m;
 
     int replyCount = 0; // 確定局面以外の応手の数
     Move oneReply = MOVE_NONE;
+    bool mate_path = false; // 詰み手順上にあるか
 
     no_mate_depth = MAX_PLY; // 有効な指し手が一つもなければこのnodeはいくらdepthがあろうと詰まない。
 
-    while ((m = mp.next_move()) && !Signals.stop && !mate_found)
+    while ((m = mp.next_move()) && !search_aborted())
     {
-      if (!pos.legal(m))
-        continue;
-
-      pos.do_move(m, si, pos.gives_check(m));
+      mp.do_move(si);
 
-      if (pos.is_mated())
+      if (mated(pos))
       {
-        // 後手の詰みなら手順を表示する。先手の詰みは必要ない。
+        // 後手の詰みなら手順を確定させる。先手の詰みは必要ない。
         if (pos.side_to_move() == WHITE)
-        {
-          // 現在詰まないことが判明している探索深さ(search_depth)+2の長さの詰みを発見したときのみ。
-          while (!Signals.stop && !mate_found) // 他のスレッドが見つけるかも知れないのでそれを待ちながら…。
-          {
-            if (search_depth + 2 >= id_depth_thread /*- depth + 1*/)
-            {
-              mate_found = true;
-              sync_cout << "checkmate " << pos.moves_from_start() << sync_endl; // 開始局面からそこまでの手順
-              break;
-            }
-            sleep(100);
-          }
-        }
+          mate_path = claim_mate(ply + 1);
       } else if (depth > 1) {
         // 残り探索深さがあるなら再帰的に探索する。
         int child_no_mate_depth;
-        search(pos, depth - 1, child_no_mate_depth);
+        uint32_t child_cycle_ply;
+        mate_path = search(pos, depth - 1, child_no_mate_depth, child_cycle_ply);
         no_mate_depth = min(child_no_mate_depth + 1, no_mate_depth);
 
+        // この局面より前の局面との循環に依存した結果なら、この局面の結果もそれに依存する。
+        if (child_cycle_ply < ply)
+          cycle_ply = min(cycle_ply, child_cycle_ply);
+
         if (child_no_mate_depth != MAX_PLY)
         {
           replyCount++;
@@ -133,7 +736,25 @@ namespace CooperativeMate
         oneReply = m;
       }
       pos.undo_move(m);
+
+      // 詰み手順上の局面なら、詰みに至る指し手を置換表に記録して帰る。
+      if (mate_path)
+      {
+        path_set.erase(path_key);
+        TT.save_mate(key, m);
+        return true;
+      }
     }
+    path_set.erase(path_key);
+
+    // 停止した場合、途中で打ち切った子のno_mate_depthはMAX_PLYになっていて正しくないので置換表には記録しない。
+    // (置換表は次回の探索やファイルに保存して再起動後にも使われうるので)
+    if (search_aborted())
+      return false;
+
+    // 循環による枝刈りに依存した結果は、別の手順で到達したときには正しくないかも知れないので置換表には記録しない。
+    if (cycle_ply != MAX_PLY && !cycle_cut_exact())
+      return false;
 
     // このnodeに関して残り探索深さdepthについては詰みを調べきったので不詰めとして扱い、置換表に記録しておく。
     // また、確定局面以外の子が1つしかなればそれを置換表に書き出しておく。(次回の指し手生成をはしょるため)
@@ -141,74 +762,1498 @@ namespace CooperativeMate
       oneReply = MOVE_NONE;
 
     TT.save(key, no_mate_depth, oneReply);
+    return false;
   }
 
-  // 協力詰め探索の反復深化のループ
-  void id_loop(Position& pos, int thread_id, int thread_num)
-  {
-    pos.set_nodes_searched(0);
-    auto start_time = now();
+  // --- ABDADA
 
-    // 協力詰めの反復深化は2手ずつ深くして良い。
-    // lazy SMPっぽい並列化をする。
-    for (uint32_t depth = 1 + thread_id * 2; depth < MAX_PLY; depth += 2 * thread_num)
-    {
-      // 置換表のgenerationをインクリメントするのはmain threadだけ。
-      if (thread_id == 0)
-        TT.new_search();
+  // 複数スレッドで探索するときに、他のスレッドが探索中の局面を後回しにする。(ABDADA)
+  // 置換表のentryに探索中のスレッド数を持たせると、clusterの形式ごとにbitを割かないといけないので、
+  // 探索中のスレッド数は置換表とは別の小さなtableに持つ。
+  // 別の局面と同じ場所を共有することもあるが、後回しにする順番が変わるだけなので探索結果には影響しない。
+  // CM_ABDADAがtrueで、2スレッド以上のときに有効。
+  bool abdada = false;
 
-      int no_mate_depth;
-      id_depth_thread = depth;
-      search(pos, depth, no_mate_depth);
+  // 残り探索深さがこれ未満の局面は探索中として登録しない。(浅い局面はすぐに終わるので、後回しにしても得がない)
+  const uint32_t BusyMinDepth = 4;
 
-      if (Signals.stop || mate_found)
-        break;
+  // 探索開始局面からこの手数までの局面では、スレッドごとに指し手の順番をずらす。
+  const uint32_t DiversifyPly = 4;
 
-      // 定期的にdepth、nodes、npsを出力する。
-      auto end_time = now();
-      auto node_searched = Threads.nodes_searched(); // 全スレッドでの探索合計
-      sync_cout << "info  depth " << depth
-        << " nodes " << node_searched
-        << " nps " << (node_searched * 1000 / ((int64_t)(end_time - start_time + 1)))
-        << " hashfull " << TT.hashfull()
-        << sync_endl;
+  const size_t BusySize = 1 << 16;
+  std::atomic<uint16_t> busy_table[BusySize];
 
-      // 最大探索深さに到達する前に王手が続かなくなっていたなら終了
-      if (no_mate_depth == MAX_PLY)
-      {
-        sync_cout << "checkmate nomate" << sync_endl;
-        break;
-      }
+  std::atomic<uint16_t>& busy_entry(const TTKey& key) { return busy_table[key.key.p(1) & (BusySize - 1)]; }
 
-      // depth手では詰まないことが証明できたのでsearch_depthを書き換える。
-      // 他のスレッドが書き換える可能性もあるので値が大きいときのみ。
-      while (true)
-      {
-        auto sd = search_depth.load();
-        if (depth > sd)
-        {
-          if (search_depth.compare_exchange_weak(sd, depth))
-            break;
+  // このスレッドの番号。指し手の順番をずらすのに使う。
+  thread_local int search_thread_id = 0;
+
+  // 非再帰版の探索で、1局面ごとに積むframe。
+  struct SearchFrame
+  {
+    TTKey key;          // この局面の置換表のkey
+    StateInfo si;       // この局面から1手進めたときのStateInfo
+    uint32_t depth;     // 残り探索深さ
+    uint32_t base;      // この局面の指し手はarenaの[base,end)にある。
+    uint32_t cur;       // 次に調べる指し手のarena上の位置
+    uint32_t end;
+    Move move;          // 子局面を探索中の指し手
+    int no_mate_depth;  // 再帰版のsearch()のno_mate_depthと同じ
+    int replyCount;     // 確定局面以外の応手の数
+    Move oneReply;
+    uint32_t deferred;  // 後回しにした指し手の数。arenaの[base,base+deferred)に詰めておく。
+    bool deferring;     // 他のスレッドが探索中の子を後回しにするか
+    bool first_done;    // 最初の子を探索したか。最初の子は後回しにしない。
+    bool busy;          // この局面をbusy_tableに探索中として登録したか
+    bool on_path;       // この局面をpath_setに登録したか
+    uint32_t cycle_ply; // 再帰版のsearch()のcycle_plyと同じ
+  };
+
+  // 非再帰版の探索のスレッドごとの作業領域。
+  // frameは反復深化の深さの分だけ確保しておき、探索中には再確保しない。(StateInfoがpreviousで前の局面を指しているので)
+  // 指し手はframeごとにMAX_MOVES分を確保するのではなく、生成した数だけarenaに詰めて置く。
+  struct SearchStack
+  {
+    std::vector<SearchFrame> frames;
+    std::vector<ExtMove> arena; // 先手の指し手はExtMove::checkersに王手している駒を持つ。
+    ExtMove buffer[MAX_MOVES]; // 指し手生成用
+  };
+
+  thread_local std::unique_ptr<SearchStack> search_stack;
+
+  // 協力詰め(非再帰版)
+  // 再帰版のsearch()と同じ順番で同じ局面を探索し、同じ内容を置換表に記録する。
+  // 再帰するとMAX_PLYに近い深さではnative stackが足りなくなるので、探索の状態はSearchStackに積む。
+  // root_moves = 探索開始局面からposまでの指し手。(work stealingのtaskの局面から探索するとき)
+  //   詰み手順の候補を探索開始局面からの手順にするのと、循環局面の手数に使う。
+  bool search_nonrecursive(Position& pos, uint32_t root_depth, int& root_no_mate_depth,
+    const std::vector<Move>& root_moves = std::vector<Move>())
+  {
+    if (!search_stack)
+      search_stack.reset(new SearchStack);
+    auto& frames = search_stack->frames;
+    auto& arena = search_stack->arena;
+    ExtMove* const buffer = search_stack->buffer;
+
+    if (frames.size() < root_depth)
+      frames.resize(root_depth);
+
+    uint32_t ply = 0;
+    uint32_t top = 0;   // arenaの使用中の末尾
+    const uint32_t base_ply = (uint32_t)root_moves.size(); // 探索開始局面からこの関数の開始局面までの手数
+    uint32_t cycle_ply; // 探索を終えた局面のcycle_ply
+    uint32_t d, n;
+    int result = MAX_PLY; // 探索を終えた局面のno_mate_depth
+    bool mate_path = false;
+    Move tt_move, m;
+    ExtMove* last;
+    SearchFrame* f;
+
+  Enter:
+    // --- 局面に入る。(再帰版のsearch()の先頭)
+    f = &frames[ply];
+    f->base = f->cur = f->end = top;
+    f->depth = root_depth - ply;
+    f->busy = false;
+    f->on_path = false;
+    f->cycle_ply = MAX_PLY;
+
+    poll_limits();
+
+    // 強制停止
+    if (search_aborted())
+    {
+      result = MAX_PLY;
+      goto Leave;
+    }
+
+    // 循環局面。残り探索深さの分だけ詰まないものとして扱う。(再帰版のsearch()と同じ)
+    if (path_set.find(pos.state()->long_key(), f->cycle_ply))
+    {
+      result = f->depth;
+      goto Leave;
+    }
+
+    f->key = TT.key(pos);
+    d = f->depth;
+    if (TT.probe(f->key, d, tt_move))
+    {
+      result = d;
+      goto Leave;
+    }
+
+    // 残り1手なら1手詰めを調べるだけ。(再帰版のsearch()と同じ)
+    if (leaf_solver && f->depth == 1 && pos.side_to_move() == BLACK)
+    {
+      m = leaf_mate1(pos, tt_move, f->replyCount, f->oneReply);
+      result = f->replyCount ? 1 : MAX_PLY;
+      if (m != MOVE_NONE)
+      {
+        result = MAX_PLY;
+        mate_path = commit_mate(base_ply + ply + 1, [&] {
+          auto path = root_moves;
+          for (uint32_t i = 0; i < ply; ++i)
+            path.push_back(frames[i].move);
+          path.push_back(m);
+          return path;
+        });
+        if (mate_path)
+          TT.save_mate(f->key, m);
+      }
+      else if (!search_aborted())
+        TT.save(f->key, result, f->replyCount == 1 ? f->oneReply : MOVE_NONE);
+      goto Leave;
+    }
+
+    path_set.insert(pos.state()->long_key(), base_ply + ply);
+    f->on_path = true;
+
+    // 他のスレッドに、この局面を探索中であることを知らせる。
+    if (abdada && f->depth >= BusyMinDepth)
+    {
+      ++busy_entry(f->key);
+      f->busy = true;
+    }
+
+    pos.check_info_update();
+
+    // 王手が1つもなければ詰まない。(再帰版のsearch()と同じ)
+    if (leaf_solver && pos.side_to_move() == BLACK && tt_move == MOVE_NONE && !pos.has_legal_check())
+    {
+      result = MAX_PLY;
+      TT.save(f->key, MAX_PLY, MOVE_NONE);
+      goto Leave;
+    }
+
+    // 指し手を生成してarenaに詰める。置換表の指し手があればそれだけ。(MovePickerと同じ)
+    // arenaが足りなければ広げる。(frameにはarena上の位置しか持たないので広げても良い)
+    if (tt_move == MOVE_NONE)
+    {
+      last = (pos.side_to_move() == BLACK) ? generateMoves<LEGAL_CHECKS_ALL>(pos, buffer)
+        : generateMoves<LEGAL_EVASIONS_ALL>(pos, buffer);
+
+      // 並べ替え。評価値はscore_moves()とhistoryの和。
+      const bool by_score = order_depth && f->depth >= order_depth;
+      const bool by_history = history_depth && f->depth >= history_depth;
+      if (by_score || by_history)
+      {
+        if (by_score)
+          score_moves(pos, buffer, last);
+        else
+          for (auto it = buffer; it != last; ++it)
+            it->value = VALUE_ZERO;
+        if (by_history)
+          thread_history().add_scores(pos.side_to_move(), ply ? frames[ply - 1].move : MOVE_NONE, buffer, last);
+        sort_moves(buffer, last);
+      }
+    }
+    else
+    {
+      last = buffer + tt_move_to(pos, tt_move, buffer[0]);
+    }
+    n = (uint32_t)(last - buffer);
+    if (arena.size() < top + n)
+      arena.resize(std::max(arena.size() * 2, (size_t)top + n));
+    for (uint32_t i = 0; i < n; ++i)
+      arena[top + i] = buffer[i];
+    f->end = top += n;
+
+    // 探索開始局面に近い局面では、スレッドごとに違う指し手から調べるようにして探索する部分木を散らす。
+    if (abdada && search_thread_id != 0 && ply < DiversifyPly && n > 1)
+      std::rotate(&arena[f->base], &arena[f->base + (search_thread_id + ply) % n], &arena[f->base] + n);
+
+    f->replyCount = 0;
+    f->oneReply = MOVE_NONE;
+    f->no_mate_depth = MAX_PLY;
+    f->deferred = 0;
+    f->deferring = abdada && f->depth > BusyMinDepth;
+    f->first_done = false;
+
+  Next:
+    // --- 次の指し手を調べる。(再帰版のsearch()の指し手のループ)
+    while (f->cur < f->end && !search_aborted())
+    {
+      const ExtMove& e = arena[f->cur++];
+      m = e.move;
+      do_search_move(pos, e, f->si);
+
+      if (mated(pos))
+      {
+        if (pos.side_to_move() == WHITE)
+          mate_path = commit_mate(base_ply + ply + 1, [&] {
+            auto path = root_moves;
+            for (uint32_t i = 0; i < ply; ++i)
+              path.push_back(frames[i].move);
+            path.push_back(m);
+            return path;
+          });
+      } else if (f->depth > 1) {
+        // 他のスレッドが探索中の子は後回しにする。
+        // 調べ終わった指し手の場所に詰めるので、まだ調べていない指し手を上書きすることはない。
+        if (f->deferring && f->first_done && busy_entry(TT.key(pos)) > 0)
+        {
+          pos.undo_move(m);
+          arena[f->base + f->deferred++] = e;
+          continue;
+        }
+        f->first_done = true;
+
+        // 子局面に入る。
+        f->move = m;
+        ++ply;
+        goto Enter;
+      } else {
+        f->no_mate_depth = 1;
+        f->replyCount++;
+        f->oneReply = m;
+      }
+      pos.undo_move(m);
+
+      if (mate_path)
+      {
+        TT.save_mate(f->key, m);
+        goto Leave;
+      }
+    }
+
+    // 後回しにした指し手を調べる。今度は後回しにしない。
+    if (f->deferred > 0 && !search_aborted())
+    {
+      f->cur = f->base;
+      f->end = top = f->base + f->deferred;
+      f->deferred = 0;
+      f->deferring = false;
+      goto Next;
+    }
+
+    if (!search_aborted() && (f->cycle_ply == MAX_PLY || cycle_cut_exact()))
+    {
+      if (f->replyCount != 1)
+        f->oneReply = MOVE_NONE;
+      TT.save(f->key, f->no_mate_depth, f->oneReply);
+    }
+    result = f->no_mate_depth;
+
+  Leave:
+    // --- 局面から出て、親の局面に結果を返す。(再帰版のsearch()のreturnと、その呼び出し元の続き)
+    if (f->busy)
+      --busy_entry(f->key);
+    if (f->on_path)
+      path_set.erase(pos.state()->long_key());
+    cycle_ply = f->cycle_ply;
+    top = f->base;
+    if (ply == 0)
+    {
+      root_no_mate_depth = result;
+      return mate_path;
+    }
+
+    f = &frames[--ply];
+    m = f->move;
+    if (!mate_path)
+    {
+      f->no_mate_depth = min(result + 1, f->no_mate_depth);
+      if (result != MAX_PLY)
+      {
+        f->replyCount++;
+        f->oneReply = m;
+      }
+      if (cycle_ply < base_ply + ply)
+        f->cycle_ply = min(f->cycle_ply, cycle_ply);
+    }
+    pos.undo_move(m);
+
+    // 停止したときの結果は正しくないのでhistoryは更新しない。
+    if (history_depth && f->depth >= history_depth && !mate_path && !search_aborted())
+      thread_history().update(pos.side_to_move(), ply ? frames[ply - 1].move : MOVE_NONE, m, result != MAX_PLY, f->depth);
+
+    if (mate_path)
+    {
+      TT.save_mate(f->key, m);
+      goto Leave;
+    }
+    goto Next;
+  }
+
+  uint64_t id_search(Position& pos, uint32_t max_depth, bool recursive, uint32_t& mate_length)
+  {
+    search_depth = 0;
+    mate_found = false;
+    solution_length = 0;
+    candidate_length = MAX_PLY;
+    pos.set_nodes_searched(0);
+
+    for (uint32_t depth = 1; depth <= max_depth; depth += 2)
+    {
+      TT.new_search();
+      history_new_iteration(depth == 1);
+      id_depth_thread = depth;
+      int no_mate_depth;
+      uint32_t cycle_ply;
+      bool mate = recursive ? search(pos, depth, no_mate_depth, cycle_ply) : search_nonrecursive(pos, depth, no_mate_depth);
+      if (mate || no_mate_depth == MAX_PLY)
+        break;
+      search_depth = depth;
+    }
+
+    mate_length = mate_found ? solution_length : 0;
+    mate_found = false;
+    return pos.nodes_searched();
+  }
+
+  // --- work stealing
+
+  // CM_WorkStealingがtrueのとき、lazy SMPの代わりにwork stealingで並列化する。
+  // 全スレッドが同じ深さの反復深化を協力して探索する。
+  //  ・探索開始局面からCM_SplitPly手までの局面を、その局面までの指し手の列(StealTask)として各スレッドのdequeに積む。
+  //    自分のdequeは後ろから取り出して、空なら他のスレッドのdequeの前から盗む。(前のほうが大きな部分木なので)
+  //  ・CM_SplitPly手に達した局面は、search_nonrecursive()でその部分木を探索する。
+  //  ・すべてのtaskが終わったら、main threadが探索開始局面から逐次探索し直して、分割した局面の結果を置換表に反映させる。
+  //    分割した局面の子はすべて置換表に載っているので、この探索はすぐに終わる。
+  bool work_stealing = false;
+
+  // 分割する手数。CM_SplitPlyの値。
+  uint32_t split_ply = 6;
+
+  // 残り探索深さがこれ以下の局面は分割しない。(部分木が小さすぎてtaskの出し入れのほうが高くつくので)
+  const uint32_t MinSplitDepth = 6;
+
+  struct StealTask
+  {
+    std::vector<Move> moves; // 探索開始局面からの指し手
+    uint32_t depth;          // このtaskを積んだ反復深化の深さ
+  };
+
+  // スレッドごとのdeque。taskは部分木単位なので大きく、lockを取っても問題にならない。
+  struct TaskDeque
+  {
+    std::mutex mutex;
+    std::deque<StealTask> tasks;
+  };
+
+  // Threadsの上限が128なので、その数だけ用意しておく。
+  TaskDeque task_deques[128];
+
+  // 積まれていて、まだ終わっていないtaskの数。0になれば、この深さの探索は終わり。
+  std::atomic<int> pending_tasks;
+
+  // dequeに積まれていて、まだ取り出されていないtaskの数。
+  std::atomic<int> queued_tasks;
+
+  // 反復深化が終わった。
+  std::atomic<bool> steal_finished;
+
+  // taskが積まれたとき、pending_tasksが0になったとき、反復深化が終わったときに、待っているスレッドを起こす。
+  std::mutex steal_mutex;
+  std::condition_variable steal_cv;
+
+  // steal_cvで待っているスレッドの数。誰も待っていなければ起こす手間を省く。
+  std::atomic<int> steal_waiters;
+
+  void notify_steal()
+  {
+    // 待つ側はsteal_waitersを増やしてから条件を調べるので、条件を変えたあとに0なら起こす必要はない。
+    // 待つ側はsteal_mutexを取ってから条件を調べるので、lockを経由すれば起こし損ねない。
+    if (steal_waiters == 0)
+      return;
+    { std::unique_lock<std::mutex> lk(steal_mutex); }
+    steal_cv.notify_all();
+  }
+
+  // taskが取り出せるようになるか、探索を終えるまで待つ。main threadはpending_tasksが0になったときにも起きる。
+  // stopコマンドは通知されないので、一定時間ごとに起きて調べる。
+  void wait_task(bool main_thread)
+  {
+    std::unique_lock<std::mutex> lk(steal_mutex);
+    ++steal_waiters;
+    steal_cv.wait_for(lk, std::chrono::milliseconds(1), [main_thread] {
+      return queued_tasks > 0 || (main_thread && pending_tasks == 0) || steal_finished || Signals.stop || mate_found;
+    });
+    --steal_waiters;
+  }
+
+  void push_task(int thread_id, StealTask&& task)
+  {
+    ++pending_tasks;
+    {
+      std::unique_lock<std::mutex> lk(task_deques[thread_id].mutex);
+      task_deques[thread_id].tasks.push_back(std::move(task));
+    }
+    ++queued_tasks;
+    notify_steal();
+  }
+
+  // 自分のdequeの後ろから、なければ他のスレッドのdequeの前から取り出す。
+  bool pop_task(int thread_id, int thread_num, StealTask& task)
+  {
+    for (int i = 0; i < thread_num; ++i)
+    {
+      auto& q = task_deques[(thread_id + i) % thread_num];
+      std::unique_lock<std::mutex> lk(q.mutex);
+      if (q.tasks.empty())
+        continue;
+      if (i == 0)
+      {
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+      } else {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+      }
+      --queued_tasks;
+      return true;
+    }
+    return false;
+  }
+
+  // taskを1つ処理する。posは探索開始局面。
+  void run_task(Position& pos, int thread_id, const StealTask& task)
+  {
+    const uint32_t depth = task.depth;
+    const size_t plies = task.moves.size();
+    std::unique_ptr<StateInfo[]> si(new StateInfo[plies + 1]);
+    for (size_t i = 0; i < plies; ++i)
+    {
+      // 循環局面を検出できるように、途中の局面も手順に加えておく。
+      path_set.insert(pos.state()->long_key(), (uint32_t)i);
+      pos.check_info_update();
+      pos.do_move(task.moves[i], si[i], pos.gives_check(task.moves[i]));
+    }
+
+    const uint32_t rest = depth - (uint32_t)plies;
+    bool mate_path = false;
+    uint32_t cycle_ply;
+
+    // 循環局面なら何もしない。(この局面の結果は最後の逐次探索で求める)
+    if (path_set.find(pos.state()->long_key(), cycle_ply))
+      ;
+    else if (plies < split_ply && rest > MinSplitDepth)
+    {
+      // 子局面をtaskとして積む。置換表で枝刈りできる局面は積まない。
+      Move tt_move;
+      uint32_t d = rest;
+      if (!TT.probe(TT.key(pos), d, tt_move))
+      {
+        pos.check_info_update();
+        MovePicker mp(pos, tt_move, rest);
+        Move m;
+        while ((m = mp.next_move()) && !Signals.stop && !mate_found && !mate_path)
+        {
+          mp.do_move(si[plies]);
+          if (mated(pos))
+          {
+            if (pos.side_to_move() == WHITE)
+              mate_path = commit_mate((uint32_t)plies + 1, [&] {
+                auto path = task.moves;
+                path.push_back(m);
+                return path;
+              });
+          } else {
+            StealTask child;
+            child.moves = task.moves;
+            child.moves.push_back(m);
+            child.depth = depth;
+            push_task(thread_id, std::move(child));
+          }
+          pos.undo_move(m);
+
+          if (mate_path)
+            TT.save_mate(TT.key(pos), m);
+        }
+      }
+    } else {
+      int no_mate_depth;
+      mate_path = search_nonrecursive(pos, rest, no_mate_depth, task.moves);
+    }
+
+    // 詰み手順上にあったなら、探索開始局面までの局面にも詰みに至る指し手を記録しておく。
+    for (size_t i = plies; i > 0; --i)
+    {
+      pos.undo_move(task.moves[i - 1]);
+      path_set.erase(pos.state()->long_key());
+      if (mate_path)
+        TT.save_mate(TT.key(pos), task.moves[i - 1]);
+    }
+
+    if (mate_path)
+    {
+      solution = mate_line(pos, solution_length);
+      if (solution.empty())
+        sync_cout << "info string failed to rebuild the mate line from TT." << sync_endl;
+      if (max_solutions == 1)
+        sync_cout << "checkmate " << solution << sync_endl;
+    }
+  }
+
+  // taskを1つ終えた。この深さの最後のtaskなら、待っているmain threadを起こす。
+  void finish_task()
+  {
+    if (--pending_tasks == 0)
+      notify_steal();
+  }
+
+  // work stealingでこの深さのtaskがなくなるまで処理する。(main thread用)
+  void steal_loop(Position& pos, int thread_id, int thread_num)
+  {
+    StealTask task;
+    while (pending_tasks > 0 && !Signals.stop && !mate_found)
+    {
+      if (!pop_task(thread_id, thread_num, task))
+      {
+        wait_task(true);
+        continue;
+      }
+      run_task(pos, thread_id, task);
+      finish_task();
+    }
+  }
+
+  // work stealing版の反復深化のループ
+  void id_loop_steal(Position& pos, int thread_id, int thread_num)
+  {
+    search_thread_id = thread_id;
+    pos.set_nodes_searched(0);
+    auto start_time = now();
+
+    if (thread_id != 0)
+    {
+      // main threadが積んだtaskを手伝う。反復深化の深さはtaskが持っている。
+      uint32_t last_depth = 0;
+      StealTask task;
+      while (!steal_finished && !Signals.stop && !mate_found)
+      {
+        if (!pop_task(thread_id, thread_num, task))
+        {
+          wait_task(false);
+          continue;
+        }
+        if (task.depth != last_depth)
+        {
+          id_depth_thread = task.depth;
+          id_depth[thread_id] = task.depth;
+          history_new_iteration(last_depth == 0);
+          last_depth = task.depth;
+        }
+        run_task(pos, thread_id, task);
+        finish_task();
+      }
+      return;
+    }
+
+    for (uint32_t depth = start_depth; depth < MAX_PLY; depth += 2)
+    {
+      TT.new_search();
+      history_new_iteration(depth == start_depth);
+      id_depth_thread = depth;
+      id_depth[thread_id] = depth;
+
+      // 探索開始局面のtaskを積む。
+      StealTask root;
+      root.depth = depth;
+      push_task(thread_id, std::move(root));
+      // 他のスレッドが処理中のtaskが終わってpending_tasksが0になるまで抜けない。
+      steal_loop(pos, thread_id, thread_num);
+
+      if (Signals.stop || mate_found)
+        break;
+
+      // 分割した局面の結果を置換表に反映させる。
+      int no_mate_depth;
+      search_nonrecursive(pos, depth, no_mate_depth);
+
+      if (Signals.stop || mate_found)
+        break;
+
+      auto end_time = now();
+      auto node_searched = Threads.nodes_searched();
+      sync_cout << "info  depth " << depth
+        << " nodes " << node_searched
+        << " nps " << (node_searched * 1000 / ((int64_t)(end_time - start_time + 1)))
+        << " hashfull " << TT.hashfull()
+        << sync_endl;
+
+      if (no_mate_depth == MAX_PLY)
+      {
+        nomate_proven = true;
+        sync_cout << "checkmate nomate" << sync_endl;
+        break;
+      }
+
+      search_depth = depth;
+    }
+
+    // 中断したときに残っているtaskを捨てる。
+    for (int i = 0; i < thread_num; ++i)
+    {
+      std::unique_lock<std::mutex> lk(task_deques[i].mutex);
+      task_deques[i].tasks.clear();
+    }
+    queued_tasks = 0;
+    pending_tasks = 0;
+    steal_finished = true;
+    notify_steal();
+  }
+
+  // lazy SMPで各スレッドが探索する深さを割り振る。
+  // 固定の間隔(thread_num * 2手)で割り振ると、スレッド数が多いときに、まだ浅い深さが証明できていないのに
+  // はるか先の深さを探索するスレッドが出てしまう。そこで、まだ詰まないことが証明されていない一番浅い深さ(frontier)
+  // から順に、深さごとに上限の数までスレッドを割り当てる。
+  // 上限はfrontierがthread_num / 2、その次が thread_num / 4、…と半分にしていき、最低1とする。
+  // search_depthが進むと、それ以下の深さを探索していたスレッドはsearch_aborted()で打ち切られて、次の深さを受け取り直す。
+  struct DepthScheduler
+  {
+    // 探索する深さを受け取る。探索を終了するときは0を返す。
+    uint32_t claim(int thread_num)
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      if (Signals.stop || mate_found || nomate_proven)
+        return 0;
+
+      const uint32_t sd = search_depth;
+      const uint32_t frontier = sd < start_depth ? start_depth : sd + 2;
+
+      // 証明済みの深さは忘れる。
+      workers.erase(workers.begin(), workers.lower_bound(frontier));
+
+      // 詰み手順の候補があれば、それ以上の深さを探索する意味はない。
+      // 候補より浅い深さが全部上限まで埋まっていれば、frontierを手伝う。
+      const uint32_t max_depth = std::min((uint32_t)MAX_PLY, (uint32_t)candidate_length);
+      if (frontier >= max_depth)
+        return 0;
+      for (uint32_t i = 0; ; ++i)
+      {
+        const uint32_t depth = frontier + i * 2;
+        if (depth >= max_depth)
+        {
+          workers[frontier]++;
+          return frontier;
+        }
+        const int limit = std::max(1, thread_num >> std::min(i + 1, 31u));
+        if (workers[depth] < limit)
+        {
+          workers[depth]++;
+          return depth;
+        }
+      }
+    }
+
+    // claim()で受け取った深さの探索を終えた。
+    void release(uint32_t depth)
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      auto it = workers.find(depth);
+      if (it != workers.end() && --it->second == 0)
+        workers.erase(it);
+    }
+
+    void clear()
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      workers.clear();
+    }
+
+  private:
+    std::mutex mutex;
+    std::map<uint32_t, int> workers; // 深さ → その深さを探索中のスレッドの数
+  };
+
+  DepthScheduler depth_scheduler;
+
+  // 協力詰め探索の反復深化のループ
+  void id_loop(Position& pos, int thread_id, int thread_num)
+  {
+    if (work_stealing)
+    {
+      id_loop_steal(pos, thread_id, thread_num);
+      return;
+    }
+    search_thread_id = thread_id;
+
+    pos.set_nodes_searched(0);
+    auto start_time = now();
+
+    // 協力詰めの反復深化は2手ずつ深くして良い。
+    // lazy SMPっぽい並列化をする。探索する深さはdepth_schedulerから受け取る。
+    // checkpointから再開したときは、詰まないことがわかっている深さの次から始める。
+    uint32_t depth;
+    bool first = true;
+    while ((depth = depth_scheduler.claim(thread_num)) != 0)
+    {
+      // 置換表のgenerationをインクリメントするのはmain threadだけ。
+      if (thread_id == 0)
+        TT.new_search();
+      history_new_iteration(first);
+      first = false;
+
+      int no_mate_depth;
+      id_depth_thread = depth;
+      id_depth[thread_id] = depth;
+      if (search_nonrecursive(pos, depth, no_mate_depth))
+      {
+        // 詰み手順はcommit_mate()で記録したもの(なければ置換表から復元する)。
+        solution = mate_line(pos, solution_length);
+        if (solution.empty())
+          sync_cout << "info string failed to rebuild the mate line from TT." << sync_endl;
+
+        // 別解を列挙するときは、列挙し終わってからfinalize()で出力する。
+        if (max_solutions == 1)
+          sync_cout << "checkmate " << solution << sync_endl;
+      }
+      depth_scheduler.release(depth);
+
+      if (Signals.stop || mate_found)
+        break;
+
+      // 他のスレッドがこの深さ以上で詰まないことを証明したので打ち切った。次の深さを受け取り直す。
+      if (search_aborted())
+        continue;
+
+      // 定期的にdepth、nodes、npsを出力する。
+      auto end_time = now();
+      auto node_searched = Threads.nodes_searched(); // 全スレッドでの探索合計
+      sync_cout << "info  depth " << depth
+        << " nodes " << node_searched
+        << " nps " << (node_searched * 1000 / ((int64_t)(end_time - start_time + 1)))
+        << " hashfull " << TT.hashfull()
+        << sync_endl;
+
+      // 最大探索深さに到達する前に王手が続かなくなっていたなら終了
+      if (no_mate_depth == MAX_PLY)
+      {
+        nomate_proven = true;
+        sync_cout << "checkmate nomate" << sync_endl;
+        break;
+      }
+
+      // depth手では詰まないことが証明できたのでsearch_depthを書き換える。
+      // 他のスレッドが書き換える可能性もあるので値が大きいときのみ。
+      while (true)
+      {
+        auto sd = search_depth.load();
+        if (depth > sd)
+        {
+          if (search_depth.compare_exchange_weak(sd, depth))
+            break;
         } else break; // 下回っているので書き込む価値はない。
       }
+
+      // 登録されていた詰み手順の候補が確定できるようになったかも知れない。
+      release_candidate();
     }
   }
 
-  void init()
+  // --- 別解の列挙
+
+  // 別解の列挙中であるか
+  bool enumerating = false;
+
+  // 列挙用の探索開始局面からの指し手の列。各スレッドはここから1つずつ取り出して、その先を列挙する。
+  std::vector<std::vector<Move>> enum_tasks;
+  std::atomic<size_t> enum_next_task;
+
+  // 見つけた解の数
+  std::atomic<uint64_t> enum_count;
+
+  // CM_Solutionsで指定された数だけ見つけたので打ち切る。
+  std::atomic<bool> enum_full;
+
+  // enum_tasksを作る。スレッドに仕事が行き渡るように、plies手までの指し手の列に展開しておく。
+  void make_enum_tasks(Position& pos, uint32_t depth, uint32_t plies, std::vector<Move>& moves)
+  {
+    if (plies == 0)
+    {
+      enum_tasks.push_back(moves);
+      return;
+    }
+
+    Move tt_move;
+    uint32_t d = depth;
+    if (TT.probe(TT.key(pos), d, tt_move))
+      return;
+
+    StateInfo si;
+    pos.check_info_update();
+    MovePicker mp(pos, tt_move);
+    Move m;
+    while ((m = mp.next_move()))
+    {
+      mp.do_move(si);
+      // ここで詰む(先手が詰まされる)なら、この先に解はない。
+      // 後手が詰むのは最短手数より短い詰みなのでありえない。
+      if (!pos.is_mated())
+      {
+        moves.push_back(m);
+        make_enum_tasks(pos, depth - 1, plies - 1, moves);
+        moves.pop_back();
+      }
+      pos.undo_move(m);
+    }
+  }
+
+  // ちょうどdepth手で詰む手順をすべて列挙して、その数を返す。movesは探索開始局面からここまでの指し手。
+  // 最短手数(solution_length)より短い詰みはないことが証明されているので、
+  // 置換表の不詰めの情報で枝刈りできる。また、解が1つもなかった局面は、残りdepth手では詰まないので置換表に記録できる。
+  uint64_t enumerate_search(Position& pos, uint32_t depth, std::vector<Move>& moves)
+  {
+    poll_limits();
+
+    if (Signals.stop || enum_full)
+      return 0;
+
+    auto key = TT.key(pos);
+    Move tt_move;
+    uint32_t d = depth;
+    if (TT.probe(key, d, tt_move))
+      return 0;
+
+    StateInfo si;
+    pos.check_info_update();
+
+    MovePicker mp(pos, tt_move);
+    Move m;
+    uint64_t count = 0;
+
+    while ((m = mp.next_move()) && !Signals.stop && !enum_full)
+    {
+      mp.do_move(si);
+      moves.push_back(m);
+
+      if (pos.is_mated())
+      {
+        if (pos.side_to_move() == WHITE && depth == 1)
+        {
+          ++count;
+          auto n = ++enum_count;
+          if (max_solutions != 0)
+          {
+            if (n <= (uint64_t)max_solutions)
+            {
+              std::stringstream ss;
+              for (auto m2 : moves)
+                ss << m2 << ' ';
+              sync_cout << "info string solution " << n << " " << ss.str() << sync_endl;
+            }
+            if (n >= (uint64_t)max_solutions)
+              enum_full = true;
+          }
+        }
+      }
+      else if (depth > 1)
+        count += enumerate_search(pos, depth - 1, moves);
+
+      moves.pop_back();
+      pos.undo_move(m);
+    }
+
+    if (count == 0 && !Signals.stop && !enum_full)
+      TT.save(key, depth, MOVE_NONE);
+
+    return count;
+  }
+
+  bool start_enumeration(Position& root)
+  {
+    enumerating = false;
+    if (max_solutions == 1 || !mate_found || Signals.stop)
+      return false;
+
+    enum_tasks.clear();
+    enum_next_task = 0;
+    enum_count = 0;
+    enum_full = false;
+
+    std::vector<Move> moves;
+    make_enum_tasks(root, solution_length, std::min(solution_length - 1, 2u), moves);
+
+    enumerating = true;
+    return true;
+  }
+
+  void enumerate(Position& root)
+  {
+    size_t i;
+    while ((i = enum_next_task++) < enum_tasks.size() && !Signals.stop && !enum_full)
+    {
+      auto moves = enum_tasks[i];
+      StateInfo si[2];
+      for (size_t j = 0; j < moves.size(); ++j)
+      {
+        root.check_info_update();
+        root.do_move(moves[j], si[j], root.gives_check(moves[j]));
+      }
+
+      const size_t plies = moves.size();
+      enumerate_search(root, solution_length - (uint32_t)plies, moves);
+
+      for (size_t j = plies; j > 0; --j)
+        root.undo_move(moves[j - 1]);
+    }
+  }
+
+  uint64_t key_fingerprint()
+  {
+    Position pos;
+    pos.set_hirate();
+    const Key128 key = pos.state()->long_key();
+    return key.p(0) ^ key.p(1);
+  }
+
+  // --- checkpoint
+
+  // 長時間の探索が異常終了したり、計画的に中断したりしたときに、そこから再開するための情報。
+  // "key value"の行からなるテキストファイルとして書き出す。
+  // 置換表そのものは含まず、CM_HashFileに置いた置換表のファイル名と世代を記録しておく。
+  struct Checkpoint
+  {
+    std::string sfen;        // 探索開始局面
+    uint32_t search_depth;   // 詰まないことがわかっている深さ
+    std::vector<uint32_t> thread_depth; // 各スレッドの反復深化の深さ
+    uint16_t generation;     // 置換表の世代
+    std::string hash_file;   // 置換表を置いたファイル。空ならファイルに置いていない。
+    size_t hash_mb;          // 置換表のサイズ[MB]
+    int64_t nodes;           // ここまでの探索ノード数(再開前の分も含む)
+    int64_t time;            // ここまでの探索時間[ms](再開前の分も含む)
+
+    // 書き出し中に異常終了しても前回のcheckpointが壊れないように、一時ファイルに書き出してからrenameする。
+    bool write(const std::string& path) const
+    {
+      const std::string tmp = path + ".tmp";
+      {
+        std::ofstream fs(tmp, std::ios::out | std::ios::trunc);
+        if (!fs)
+          return false;
+        fs << "sfen " << sfen << endl
+          << "search_depth " << search_depth << endl
+          << "thread_depth";
+        for (auto d : thread_depth)
+          fs << " " << d;
+        fs << endl
+          << "generation " << generation << endl
+          << "hash_file " << hash_file << endl
+          << "hash_mb " << hash_mb << endl
+          << "nodes " << nodes << endl
+          << "time " << time << endl;
+        fs.flush();
+        if (!fs)
+          return false;
+      }
+#ifdef _WIN32
+      // Windowsのrename()は既存のファイルを上書きしないので先に消す。
+      std::remove(path.c_str());
+#endif
+      return std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    bool read(const std::string& path)
+    {
+      std::ifstream fs(path);
+      if (!fs)
+        return false;
+
+      *this = Checkpoint();
+      std::string line, token;
+      while (getline(fs, line))
+      {
+        istringstream is(line);
+        is >> token;
+        if (token == "sfen") getline(is >> ws, sfen);
+        else if (token == "search_depth") is >> search_depth;
+        else if (token == "thread_depth") { uint32_t d; while (is >> d) thread_depth.push_back(d); }
+        else if (token == "generation") is >> generation;
+        else if (token == "hash_file") getline(is >> ws, hash_file);
+        else if (token == "hash_mb") is >> hash_mb;
+        else if (token == "nodes") is >> nodes;
+        else if (token == "time") is >> time;
+      }
+      return !sfen.empty();
+    }
+
+    Checkpoint() : search_depth(0), generation(0), hash_mb(0), nodes(0), time(0) {}
+  };
+
+  // checkpointを定期的に書き出すスレッド。
+  // 探索スレッドを止めずに、探索の進捗(atomicな変数)を読み出して書き出す。
+  struct CheckpointWriter
+  {
+    // 書き出しを開始する。pathが空なら何もしない。
+    void start(const Position& root, const std::string& path_, int interval_sec)
+    {
+      path = path_;
+      if (path.empty())
+        return;
+
+      root_sfen = root.sfen();
+      exit = false;
+      th = std::thread([this, interval_sec] {
+        std::unique_lock<std::mutex> lk(mutex);
+        while (!cv.wait_for(lk, std::chrono::seconds(interval_sec), [this] { return exit; }))
+          write();
+      });
+    }
+
+    // 書き出しスレッドを終了させる。final == trueなら最後にもう一度書き出す。
+    void stop(bool final)
+    {
+      if (path.empty())
+        return;
+
+      {
+        std::unique_lock<std::mutex> lk(mutex);
+        exit = true;
+      }
+      cv.notify_one();
+      th.join();
+
+      if (final)
+        write();
+      path.clear();
+    }
+
+    void write()
+    {
+      Checkpoint cp;
+      cp.sfen = root_sfen;
+      cp.search_depth = search_depth;
+      for (size_t i = 0; i < Threads.size(); ++i)
+        cp.thread_depth.push_back(id_depth[i]);
+      cp.generation = TT.generation();
+      cp.hash_file = (std::string)Options["CM_HashFile"];
+      cp.hash_mb = (int)Options["CM_Hash"];
+      cp.nodes = resumed.nodes + Threads.nodes_searched();
+      cp.time = resumed.time + (now() - start_time);
+
+      // 置換表の中身がcheckpointの時点より古くならないように、書き出しを開始させておく。(完了は待たない)
+      if (TT.persistent())
+        TT.flush(false);
+
+      if (!cp.write(path))
+        sync_cout << "info string failed to write checkpoint " << path << sync_endl;
+    }
+
+    // 再開したcheckpoint。(再開していなければ空)
+    Checkpoint resumed;
+    // 探索開始時刻
+    TimePoint start_time;
+
+  private:
+    std::string path, root_sfen;
+    std::thread th;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool exit;
+  };
+
+  CheckpointWriter checkpoint;
+
+  // load_checkpoint()で読み込んで、次のgo mateで再開するcheckpoint
+  Checkpoint pending_resume;
+  bool resume_pending = false;
+
+  bool load_checkpoint(const std::string& path, std::string& sfen)
+  {
+    Checkpoint cp;
+    if (!cp.read(path))
+      return false;
+
+    // 置換表をファイルに置いていたなら、そのファイルを読み込む。
+    if (!cp.hash_file.empty() && (std::string)Options["CM_HashFile"] != cp.hash_file)
+    {
+      Options["CM_Hash"] = std::to_string(cp.hash_mb);
+      Options["CM_HashFile"] = cp.hash_file;
+    }
+    TT.prepare();
+    if (!TT.persistent())
+      clear_hash();
+
+    if (cp.hash_file.empty() || !TT.persistent())
+      sync_cout << "info string no TT snapshot. resume from depth " << cp.search_depth << " with an empty TT." << sync_endl;
+    else if (TT.generation() < cp.generation)
+      sync_cout << "info string TT snapshot is older than the checkpoint." << sync_endl;
+
+    sfen = cp.sfen;
+    pending_resume = cp;
+    resume_pending = true;
+    return true;
+  }
+
+  void init(const Position& root)
   {
     search_depth = 0;
+    start_depth = 1;
     mate_found = false;
+    nomate_proven = false;
+    solution.clear();
+    solution_length = 0;
+    max_solutions = Options["CM_Solutions"];
+    enumerating = false;
+    work_stealing = Options["CM_WorkStealing"];
+    split_ply = (int)Options["CM_SplitPly"];
+    abdada = Options["CM_ABDADA"] && Options["Threads"] > 1;
+    order_depth = (int)Options["CM_OrderDepth"];
+    history_depth = (int)Options["CM_HistoryDepth"];
+    leaf_solver = Options["CM_LeafSolver"];
+
+    // "go mate infinite"はINT32_MAXになっている。
+    time_budget = Limits.mate != INT32_MAX ? Limits.mate : 0;
+    if (Limits.movetime)
+      time_budget = time_budget ? std::min(time_budget, (int64_t)Limits.movetime) : Limits.movetime;
+    node_budget = Limits.nodes;
+    hashfull_budget = (int)Options["CM_HashfullLimit"];
+    search_start_time = now();
+    budget_exceeded = false;
+    depth_scheduler.clear();
+    candidate.clear();
+    candidate_length = MAX_PLY;
+    for (auto& b : busy_table)
+      b = 0;
+    pending_tasks = 0;
+    queued_tasks = 0;
+    steal_waiters = 0;
+    steal_finished = false;
+    for (auto& d : id_depth)
+      d = 0;
+
+    checkpoint.resumed = Checkpoint();
+    if (resume_pending)
+    {
+      // 再開する局面が同じときだけ再開する。
+      if (pending_resume.sfen == root.sfen())
+      {
+        checkpoint.resumed = pending_resume;
+        search_depth = pending_resume.search_depth;
+        start_depth = search_depth + 2;
+        sync_cout << "info string resume from depth " << search_depth << sync_endl;
+      }
+      resume_pending = false;
+    }
+
+    checkpoint.start_time = now();
+    checkpoint.start(root, Options["CM_Checkpoint"], Options["CM_CheckpointInterval"]);
+  }
+
+  bool clearing_hash = false;
+
+  void clear_hash()
+  {
+    // 探索スレッドに分担させるので、isreadyより前(置換表のメモリを確保していない)なら何もしない。
+    if (Threads.empty())
+      return;
+
+    // go mateと同じようにmain threadを起こして、MainThread::think()からclear_hash_slice()を呼び出させる。
+    auto main = Threads.main();
+    main->join();
+    clearing_hash = true;
+    main->thinking = true;
+    main->notify_one();
+    main->join();
+    clearing_hash = false;
+  }
+
+  void clear_hash_slice(size_t thread_id)
+  {
+    TT.clear_slice(thread_id, Threads.size());
   }
 
   void finalize()
   {
-    if (!Signals.stop && !mate_found)
+    // 詰みを見つける前に停止した(stopコマンドなど)なら、再開できるように最後のcheckpointを書き出す。
+    checkpoint.stop(Signals.stop && !mate_found);
+
+    // ファイルに置いた置換表なら、ここまでの中身をファイルに書き出しておく。
+    TT.flush(false);
+
+    if (enumerating)
+    {
+      // 列挙しきったか。CM_Solutionsの数だけ見つけて打ち切ったときやstopで止めたときは、それ以上あるかも知れない。
+      bool complete = !enum_full && !Signals.stop;
+      sync_cout << "info string solutions " << (complete ? "" : ">= ") << enum_count
+        << (complete && enum_count == 1 ? " (unique)" : "") << sync_endl;
+      sync_cout << "checkmate " << solution << sync_endl;
+    }
+    else if (budget_exceeded && !mate_found && !nomate_proven)
+    {
+      // 予算を使い切った。どの深さまで詰まないことを証明できたかを出力しておく。
+      sync_cout << "info string budget exceeded. no mate within " << search_depth << " plies." << sync_endl;
+      sync_cout << "checkmate timeout" << sync_endl;
+    }
+    else if (!Signals.stop && !mate_found)
     {
       sync_cout << "info string give up." << sync_endl;
       sync_cout << "checkmate nomate" << sync_endl; // checkmateコマンドを返さないと将棋所が待機したままになる
     }
   }
 
+  // --- batch
+
+  // batchで読み込んだsfenを調べる。問題なければ空の文字列、おかしければその理由を返す。
+  // Position::set()は正しいsfenが渡されることを前提にしていて、駒が多すぎたりするとPieceListを壊すので、その前に調べる。
+  std::string check_sfen(const std::string& sfen)
+  {
+    istringstream ss(sfen);
+    std::string board, side, hand;
+    if (!(ss >> board >> side >> hand))
+      return "too few fields";
+
+    // 駒の種類ごとの枚数。手駒と合わせて上限を超えてはいけない。玉は手番ごとに数える。
+    const int max_count[KING] = { 0, 18/*歩*/, 4/*香*/, 4/*桂*/, 4/*銀*/, 2/*角*/, 2/*飛*/, 4/*金*/ };
+    int count[KING] = {};
+    int kings[COLOR_NB] = {};
+
+    // --- 盤面
+    int rank = 0, file = 0;
+    bool promote = false;
+    size_t idx;
+    for (char c : board)
+    {
+      if (c == '/')
+      {
+        if (file != 9 || promote || ++rank > 8)
+          return "bad board";
+        file = 0;
+      }
+      else if (c >= '1' && c <= '9' && !promote)
+        file += c - '0';
+      else if (c == '+' && !promote)
+        promote = true;
+      else if (c != ' ' && (idx = PieceToCharBW.find(c)) != std::string::npos)
+      {
+        const Piece pc = (Piece)idx;
+        const Piece pt = type_of(pc);
+        if (promote && (pt == GOLD || pt == KING))
+          return "bad promotion";
+
+        // 行きどころのない駒。(指し手生成はこういう駒がないことを前提にしている)
+        const int r = color_of(pc) == BLACK ? rank : 8 - rank;
+        if (!promote && (((pt == PAWN || pt == LANCE) && r == 0) || (pt == KNIGHT && r <= 1)))
+          return "piece with no legal move";
+
+        if (pt == KING)
+          ++kings[color_of(pc)];
+        else
+          ++count[pt];
+        ++file;
+        promote = false;
+      }
+      else
+        return "bad board";
+
+      if (file > 9)
+        return "bad board";
+    }
+    if (rank != 8 || file != 9 || promote)
+      return "bad board";
+
+    // --- 手番
+    if (side != "b" && side != "w")
+      return "bad side to move";
+
+    // --- 手駒
+    if (hand != "-")
+    {
+      int ct = 0;
+      for (char c : hand)
+      {
+        if (c >= '0' && c <= '9')
+        {
+          ct = ct * 10 + (c - '0');
+          if (ct > 18)
+            return "bad hand";
+        }
+        else if (c != ' ' && (idx = PieceToCharBW.find(c)) != std::string::npos && type_of((Piece)idx) < KING)
+        {
+          count[type_of((Piece)idx)] += std::max(ct, 1);
+          ct = 0;
+        }
+        else
+          return "bad hand";
+      }
+      if (ct)
+        return "bad hand";
+    }
+
+    for (Piece pt = PAWN; pt < KING; ++pt)
+      if (count[pt] > max_count[pt])
+        return "too many pieces";
+
+    // 協力詰めなので後手玉は必須。先手玉はなくても良い。
+    if (kings[WHITE] != 1 || kings[BLACK] > 1)
+      return "bad king count";
+
+    return "";
+  }
+
+  // JSONの文字列に埋め込めるように'"'と'\\'と制御文字をescapeする。
+  std::string json_escape(const std::string& str)
+  {
+    std::string result;
+    for (char c : str)
+    {
+      if (c == '"' || c == '\\')
+        result += '\\';
+      if ((unsigned char)c < 0x20)
+        c = ' ';
+      result += c;
+    }
+    return result;
+  }
+
+  // 何も出力しないstreambuf。batchの結果を標準出力に書き出すときに、1問ごとのUSIの出力(info,checkmate)を捨てるのに使う。
+  struct NullStreamBuf : public std::streambuf
+  {
+    int overflow(int c) override { return c; }
+  };
+
+  // sfenのファイルを1行1問として順番に解き、結果をJSON Lines形式で書き出す。
+  // cmbatch <sfenファイル> [movetime <ms>] [nodes <n>] [out <出力ファイル>] [sharedhash]
+  //  movetime,nodes : 1問あたりの探索時間[ms]と探索ノード数の上限。0(省略時)なら無制限。
+  //  out            : 結果の出力先。省略時は標準出力に"info string"を付けずにそのまま出力する。
+  //                   そのときは結果の行だけを読めるように、探索中のUSIの出力(info,checkmate)は捨てる。
+  //  sharedhash     : 問題ごとに置換表をクリアしない。似た問題が並んだ作品集なら前の問題の探索結果が使える。
+  // 探索にはThreadsのスレッドをそのまま使う。batchが終わるまでは他のUSIコマンドを受け付けない。
+  void batch(istringstream& is)
+  {
+    std::string path, out_path, token;
+    int64_t time_limit = 0, node_limit = 0;
+    bool shared_hash = false;
+
+    is >> path;
+    while (is >> token)
+    {
+      if (token == "movetime") is >> time_limit;
+      else if (token == "nodes") is >> node_limit;
+      else if (token == "out") is >> out_path;
+      else if (token == "sharedhash") shared_hash = true;
+    }
+
+    std::ifstream fs(path);
+    if (!fs)
+    {
+      sync_cout << "info string can't open " << path << sync_endl;
+      return;
+    }
+
+    std::ofstream ofs;
+    if (!out_path.empty())
+    {
+      ofs.open(out_path, std::ios::out | std::ios::trunc);
+      if (!ofs)
+      {
+        sync_cout << "info string can't open " << out_path << sync_endl;
+        return;
+      }
+    }
+
+    // isreadyを経ていなくても置換表が使えるようにしておく。
+    Search::clear();
+
+    Position pos;
+    std::string line;
+    int problem = 0, solved = 0;
+    bool searched = false; // 1問でも探索したか。(2問目からは置換表をクリアする)
+    NullStreamBuf null_buf;
+    while (getline(fs, line))
+    {
+      // 空行と'#'で始まる行は読み飛ばす。"position sfen ..."や"sfen ..."の形式でも良いことにする。
+      istringstream ls(line);
+      std::string sfen;
+      while (ls >> token)
+        if (token != "position" && token != "sfen")
+          sfen += token + " ";
+      if (sfen.empty() || sfen[0] == '#')
+        continue;
+
+      // 末尾の空白を取り除いておく。
+      while (!sfen.empty() && sfen.back() == ' ')
+        sfen.pop_back();
+
+      ++problem;
+
+      // おかしなsfenは解かずにエラーとして書き出す。
+      std::string error = check_sfen(sfen);
+      if (error.empty())
+      {
+        // set()はおかしな局面だとinfo stringを出力するので、それも捨てる。
+        std::streambuf* cout_buf = ofs.is_open() ? nullptr : std::cout.rdbuf(&null_buf);
+        pos.set(sfen);
+        if (cout_buf)
+          std::cout.rdbuf(cout_buf);
+        // 手番でないほうの玉が取れる局面はおかしい。(先手玉はないこともある)
+        const Color them = ~pos.side_to_move();
+        if (pos.king_square(them) != SQ_NB && pos.attackers_to(pos.side_to_move(), pos.king_square(them)))
+          error = "king can be captured";
+      }
+      if (!error.empty())
+      {
+        std::stringstream json;
+        json << "{\"id\":" << problem
+          << ",\"sfen\":\"" << json_escape(sfen) << "\""
+          << ",\"result\":\"error\""
+          << ",\"error\":\"" << error << "\""
+          << "}";
+        if (ofs.is_open())
+          ofs << json.str() << endl;
+        else
+          sync_cout << json.str() << sync_endl;
+        continue;
+      }
+
+      if (searched && !shared_hash)
+        clear_hash();
+      searched = true;
+
+      Search::StateStackPtr states(new std::stack<StateInfo>);
+      Search::LimitsType limits;
+      limits.mate = INT32_MAX;
+      limits.movetime = (int)time_limit;
+      limits.nodes = node_limit;
+
+      // 予算は探索側で守られる。(init()でLimitsから読み込まれる)
+      auto start_time = now();
+      std::streambuf* cout_buf = ofs.is_open() ? nullptr : std::cout.rdbuf(&null_buf);
+      Threads.start_thinking(pos, limits, states);
+      Threads.main()->join();
+      if (cout_buf)
+        std::cout.rdbuf(cout_buf);
+      auto elapsed = now() - start_time;
+      bool budget_over = budget_exceeded;
+
+      const char* result = mate_found ? "mate" : nomate_proven ? "nomate" : budget_over ? "timeout" : "giveup";
+      int length = 0;
+      istringstream ms(solution);
+      while (ms >> token)
+        ++length;
+      if (mate_found)
+        ++solved;
+
+      std::string moves = solution;
+      while (!moves.empty() && moves.back() == ' ')
+        moves.pop_back();
+
+      std::stringstream json;
+      json << "{\"id\":" << problem
+        << ",\"sfen\":\"" << sfen << "\""
+        << ",\"result\":\"" << result << "\""
+        << ",\"length\":" << length
+        << ",\"moves\":\"" << moves << "\"";
+      // 別解を列挙したなら、その数も書き出す。(打ち切ったときは"solutions_complete"がfalse)
+      if (enumerating)
+        json << ",\"solutions\":" << enum_count
+          << ",\"solutions_complete\":" << (!enum_full && !budget_over ? "true" : "false");
+      json
+        << ",\"proven_depth\":" << search_depth
+        << ",\"nodes\":" << Threads.nodes_searched()
+        << ",\"time\":" << elapsed
+        << "}";
+
+      if (ofs.is_open())
+        ofs << json.str() << endl;
+      else
+        sync_cout << json.str() << sync_endl;
+    }
+
+    sync_cout << "info string batch done. solved " << solved << " / " << problem << sync_endl;
+  }
+
 } // end of namespace
 
 #endif
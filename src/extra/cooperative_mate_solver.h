@@ -3,62 +3,150 @@
 
 #include <atomic>
 #include "../position.h"
+#include "../misc.h"
 
 // --- 協力詰め探索
 
 namespace CooperativeMate
 {
-  struct TranspositionTable;
+  // --- 置換表のCluster
+  // TranspositionTableは1つのClusterがCPUのcache line(64byte)に収まるものとして、
+  // Clusterの中身(entryの形式と排他の方法)はClusterの型として差し替えられるようにしてある。
+  // Clusterに要求するのは以下のメソッド。generationは置換表側の世代カウンター。
+  //   bool probe(const Key128& key, uint32_t& depth, Move& tt_move, uint16_t generation);
+  //   void save(const Key128& key, uint32_t depth, Move move, uint16_t generation);
+  //     (depth == MATE_DEPTHのときは書き込みを省略せず、同じkeyのentryがあれば必ず上書きする)
+  //   int count_generation(uint16_t generation) const; // hashfull()用
+  //   void recover(); // 異常終了したプロセスがファイルに残した置換表を読み込んだときに、lockや書きかけのentryを解消する。
+  // hash keyの下位64bit(p(0))はClusterのindexに使い、entryの照合にはp(1)を使う。
 
-  struct TTEntry {
+  // 置換表をファイルに保存するときに、ファイルの先頭に置くheader。
+  // 置換表の中身はファイルのHeaderSizeバイト目以降にClusterの配列がそのまま置かれる。
+  // 置換表を読み込むときには、Clusterの数・形式、hash keyの生成方法がすべて合致していないといけない。
+  struct TTFileHeader {
+    static const size_t HeaderSize = 4096;
 
-    // この深さにおいて詰まない
-    uint32_t depth() const { return ((uint32_t)depth_high8 << 16) + depth16; }
+    char magic[8];            // "YOCMTT01"
+    uint64_t cluster_count;   // Clusterの数
+    uint32_t cluster_bytes;   // sizeof(Cluster)
+    uint32_t cluster_scheme;  // Clusterの形式(Cluster::Scheme)
+    uint32_t hash_key_bits;   // HASH_KEY_BITS
+    uint32_t dirty;           // mapしている間は1。正常に開放したら0。1のまま読み込んだら異常終了したということ。
+    uint64_t key_fingerprint; // hash keyの生成方法が同じであるかを調べるための値。key_fingerprint()
+    uint16_t generation;      // 置換表の世代
 
-    // この局面で指し手が1つしかないときに指し手生成処理を端折るための指し手
-    Move move() const { return (Move)move16; }
+    // headerを初期化する。
+    void init(uint64_t cluster_count_, uint32_t cluster_bytes_, uint32_t cluster_scheme_, uint64_t key_fingerprint_)
+    {
+      memset(this, 0, sizeof(*this));
+      memcpy(magic, "YOCMTT01", sizeof(magic));
+      cluster_count = cluster_count_;
+      cluster_bytes = cluster_bytes_;
+      cluster_scheme = cluster_scheme_;
+      hash_key_bits = HASH_KEY_BITS;
+      key_fingerprint = key_fingerprint_;
+    }
 
-    int64_t key() const { return key64; }
+    // 同じ形式の置換表であるか。generationは比較しない。
+    bool compatible(const TTFileHeader& h) const
+    {
+      return !memcmp(magic, h.magic, sizeof(magic))
+        && cluster_count == h.cluster_count
+        && cluster_bytes == h.cluster_bytes
+        && cluster_scheme == h.cluster_scheme
+        && hash_key_bits == h.hash_key_bits
+        && key_fingerprint == h.key_fingerprint;
+    }
+  };
 
-    // TTEntryの世代(置換表側で世代カウンターで管理)
-    uint16_t generation() const { return gen16; }
-    void set_generation(uint16_t g) { gen16 = g; }
+  // hash keyの生成方法(Zobristの乱数など)が変わっていないかを調べるための値。
+  // 平手の開始局面のhash keyを用いる。
+  uint64_t key_fingerprint();
 
-    // 置換表のエントリーに対して与えられたデータを保存する。上書き動作
-    void save(Key128 key_, uint32_t depth, Move move)
-    { depth16 = depth & 0xffff; depth_high8 = depth >> 16; key64 = key_.p(1); move16 = (uint16_t)move; }
+  // 詰み手順上の局面であることを表すentryのdepth。このentryのmoveが詰みに至る指し手。
+  // 探索終了後に置換表をrootからたどって詰み手順を復元するのに使う。(mate_line())
+  // 不詰めの証明ではないので、probe()では見つからなかったものとして扱う。
+  // depthは16bitで保持しているClusterもあるので、MAX_PLY < MATE_DEPTH <= 0xffffでなければならない。
+  static const uint32_t MATE_DEPTH = 0xffff;
+  static_assert(MAX_PLY < MATE_DEPTH, "MAX_PLY must be less than MATE_DEPTH.");
 
-    // 与えられたkey_がこのTTEntryに格納されているかを判定する。
-    bool found(Key128 key_) const { return key64 == key_.p(1); }
+  // 置換表を引くときのkey。
+  // 通常のClusterはkey(局面のhash key)だけを使う。HandClusterのときはkeyに先手の手駒を含めず、先手の手駒はhandとして持つ。
+  struct TTKey {
+    TTKey() {}
+    TTKey(const Key128& key_, Hand hand_ = HAND_ZERO) : key(key_), hand(hand_) {}
 
-  private:
-    friend struct TranspositionTable;
+    // 通常のClusterのprobe()/save()にはkeyだけが渡る。
+    operator const Key128&() const { return key; }
 
-    // この残り探索深さにおいて詰まない(24bit)
-    uint16_t depth16;
-    uint8_t depth_high8;
-    std::atomic<uint8_t> lock; // entry lock用
+    Key128 key;
+    Hand hand;
+  };
 
-    uint16_t move16;     // 1手しかないときの指し手
-    uint16_t gen16;      // 置換表の世代
-    uint64_t key64;
-    // 3 + 1 + 2 + 2 + 8 = 16
+  // replace対象を選ぶときのスコア。これが小さいものほど価値が低い。
+  // ・(残り探索深さが)深いときの探索の結果であるものほど価値があるので残しておきたい。depth × 重み1.0
+  // ・generationがいまの探索generationに近いものほど価値があるので残しておきたい。generation×重み 8.0
+  // 並列化の影響により、自分より未来のgenerationでありうるので1024を足しておく。
+  // (スレッドごとにgenerationを変えたほうがいいかも知れないが現状そうはしていないので1024は過剰ではあるが。)
+  inline int32_t replace_score(uint32_t depth, uint16_t entry_generation, uint16_t generation)
+  {
+    return (int32_t)depth - (uint16_t)(1024 + generation - entry_generation) * 8;
+  }
 
-  };
+  // Clusterごとにspin lockを取る置換表のCluster。(従来の実装)
+  struct LockedCluster {
 
-  struct TranspositionTable {
+    struct TTEntry {
+
+      // この深さにおいて詰まない
+      uint32_t depth() const { return ((uint32_t)depth_high8 << 16) + depth16; }
+
+      // この局面で指し手が1つしかないときに指し手生成処理を端折るための指し手
+      Move move() const { return (Move)move16; }
+
+      int64_t key() const { return key64; }
+
+      // TTEntryの世代(置換表側で世代カウンターで管理)
+      uint16_t generation() const { return gen16; }
+      void set_generation(uint16_t g) { gen16 = g; }
+
+      // 置換表のエントリーに対して与えられたデータを保存する。上書き動作
+      void save(const Key128& key_, uint32_t depth, Move move)
+      { depth16 = depth & 0xffff; depth_high8 = depth >> 16; key64 = key_.p(1); move16 = (uint16_t)move; }
+
+      // 与えられたkey_がこのTTEntryに格納されているかを判定する。
+      bool found(const Key128& key_) const { return key64 == key_.p(1); }
+
+    private:
+      friend struct LockedCluster;
+
+      // この残り探索深さにおいて詰まない(24bit)
+      uint16_t depth16;
+      uint8_t depth_high8;
+      std::atomic<uint8_t> lock; // entry lock用
+
+      uint16_t move16;     // 1手しかないときの指し手
+      uint16_t gen16;      // 置換表の世代
+      uint64_t key64;
+      // 3 + 1 + 2 + 2 + 8 = 16
+    };
+
+    // 1クラスターにおけるTTEntryの数
+    static const int ClusterSize = 4;
+
+    // Clusterの形式を表す値。置換表をファイルに保存するときにheaderに記録する。
+    static const uint32_t Scheme = 1;
 
     // 置換表のなかから与えられたkeyに対応するentryを探す。
-    // 置換表により深いdepthのentryがあればそのdepthを引数のdepthに反映させてtrueを返す。
+    // 置換表により深いdepthのentryがあればそのdepthと指し手を引数のdepthとtt_moveに反映させてtrueを返す。
     // 置換表により深いdepthのentryはなかったけどこのnodeのentryがあったならその指し手を
-    //   引数のtt_moveに反映させてtrueを返す。
-    // 置換表にこのnodeのentryが見つからない場合はfalseを返す。
-    bool probe(const Key128 key, uint32_t& depth , Move& tt_move)
+    //   引数のtt_moveに反映させてfalseを返す。
+    // 置換表にこのnodeのentryが見つからない場合はtt_moveをMOVE_NONEにしてfalseを返す。
+    bool probe(const Key128& key, uint32_t& depth, Move& tt_move, uint16_t generation)
     {
-      auto& cluster = table[(size_t)key.p(0) % clusterCount];
-      TTEntry* const tte = &cluster.entry[0];
+      TTEntry* const tte = &entry[0];
 
-      lock(cluster);
+      lock();
       for (int i = 0; i < ClusterSize; ++i)
       {
         // 空のエントリーを見つけた(そこまではkeyが合致していないので見つからなかったものとして終了)
@@ -72,26 +160,26 @@ namespace CooperativeMate
           if (tte[i].depth() >= depth)
           {
             depth = tte[i].depth();
-            tte[i].set_generation(generation16); // Refresh
-            unlock(cluster);
+            tt_move = tte[i].move();
+            tte[i].set_generation(generation); // Refresh
+            unlock();
             return true;
           }
           tt_move = tte[i].move();
           // いまからこのnodeを更新するのでいますぐのrefreshは不要。
-          unlock(cluster);
+          unlock();
           return false;
         }
       }
       tt_move = MOVE_NONE;
-      unlock(cluster);
+      unlock();
       return false;
     }
 
-    void save(const Key128 key,uint32_t depth,Move move)
+    void save(const Key128& key, uint32_t depth, Move move, uint16_t generation)
     {
-      auto& cluster = table[(size_t)key.p(0) % clusterCount];
-      TTEntry* const tte = &cluster.entry[0];
-      lock(cluster);
+      TTEntry* const tte = &entry[0];
+      lock();
 
       TTEntry* replace;
       for (int i = 0; i < ClusterSize; ++i)
@@ -106,10 +194,10 @@ namespace CooperativeMate
         // 同じhash keyのentryがあったのでここ以外に書き込むわけにはいかない
         if (tte[i].found(key))
         {
-          if (tte[i].depth() >= depth)
+          if (tte[i].depth() >= depth && depth != MATE_DEPTH)
           {
             // 現在のdepthのほうが深いなら書き込まずに終了。たぶん他のスレッドが書き込んだのだろう。
-            unlock(cluster);
+            unlock();
             return;
           }
           replace = &tte[i];
@@ -117,53 +205,854 @@ namespace CooperativeMate
         }
       }
 
-      replace = tte;
-
       // 一致するhash keyが格納されているTTEntryが見つからなかったし、空のエントリーも見つからなかったのでどれか一つ犠牲にする。
+      // replace_score()の一番小さいTTEntryを使う。
+      replace = tte;
       for (int i = 1; i < ClusterSize; ++i)
-
-        // ・(残り探索深さが)深いときの探索の結果であるものほど価値があるので残しておきたい。depth × 重み1.0
-        // ・generationがいまの探索generationに近いものほど価値があるので残しておきたい。generation×重み 8.0
-        // 以上に基いてスコアリングする。
-        // 以上の合計が一番小さいTTEntryを使う。
-
-        // 並列化の影響により、自分より未来のgenerationでありうるので1024を足しておく。
-        // (スレッドごとにgenerationを変えたほうがいいかも知れないが現状そうはしていないので1024は過剰ではあるが。)
-
-        if ( (int32_t)replace->depth() - (uint16_t)(1024 + generation16 - replace->generation()) * 8
-             >(int32_t)tte[i].depth()  - (uint16_t)(1024 + generation16 - tte[i].generation()  ) * 8 )
+        if (replace_score(replace->depth(), replace->generation(), generation)
+          > replace_score(tte[i].depth(), tte[i].generation(), generation))
           replace = &tte[i];
 
     WriteBack:;
-      replace->set_generation(generation16);
+      replace->set_generation(generation);
       replace->save(key, depth, move);
 
-      unlock(cluster);
+      unlock();
+    }
+
+    int count_generation(uint16_t generation) const
+    {
+      int cnt = 0;
+      for (int i = 0; i < ClusterSize; ++i)
+        if (entry[i].generation() == generation)
+          ++cnt;
+      return cnt;
+    }
+
+    void recover() { entry[0].lock = 0; }
+
+  private:
+    void lock()
+    {
+      // このClusterの1つ目のTTEntry::lockをこのClusterのlock用に使う。
+      auto& lk = entry[0].lock;
+      while (true)
+      {
+        uint8_t expected = 0;
+        if (lk.compare_exchange_weak(expected, 1))
+          break;
+        // 0なら1にして、これができたらlockできたとみなす。
+      }
+    }
+    void unlock()
+    {
+      auto& lk = entry[0].lock;
+      uint8_t expected = 1;
+      // 自分がlockしたのだから1になっているはず..
+      if (!lk.compare_exchange_weak(expected, 0))
+        ASSERT_LV1(false);
+    }
+
+    TTEntry entry[ClusterSize];
+  };
+
+  // lockを取らない置換表のCluster。
+  // entryはdataの64bitとkeyの64bitからなり、keyのほうには key ^ data を格納しておく。
+  // 他のスレッドと同時に書き込まれてkeyとdataが別々のsaveのものになったentryは照合に失敗するので、
+  // 壊れたentryは単に置換表にhitしなかったものとして扱われる。(benign race)
+  // dataもkeyもそれぞれ64bitで一度に読み書きするので、64bitの途中で書き換わることはない。
+  struct LocklessCluster {
+
+    struct TTEntry {
+
+      // data64のbit layout
+      //   bit  0..23 : この深さにおいて詰まない(24bit)
+      //   bit 24..39 : 1手しかないときの指し手
+      //   bit 40..55 : 置換表の世代
+      static uint64_t make_data(uint32_t depth, Move move, uint16_t generation)
+      { return (uint64_t)(depth & 0xffffff) | ((uint64_t)(uint16_t)move << 24) | ((uint64_t)generation << 40); }
+
+      static uint32_t depth(uint64_t data) { return (uint32_t)(data & 0xffffff); }
+      static Move move(uint64_t data) { return (Move)(uint16_t)(data >> 24); }
+      static uint16_t generation(uint64_t data) { return (uint16_t)(data >> 40); }
+
+      // 読み書きは必ずこのatomicを通じて行なう。memory orderはrelaxedで十分。
+      std::atomic<uint64_t> data64;
+      std::atomic<uint64_t> key_xor_data64;
+      // 8 + 8 = 16
+    };
+
+    static const int ClusterSize = 4;
+    static const uint32_t Scheme = 2;
+
+    // 引数と戻り値の意味はLockedCluster::probe()と同じ。
+    bool probe(const Key128& key, uint32_t& depth, Move& tt_move, uint16_t generation)
+    {
+      const uint64_t key64 = key.p(1);
+      for (int i = 0; i < ClusterSize; ++i)
+      {
+        auto& e = entry[i];
+        const uint64_t data = e.data64.load(std::memory_order_relaxed);
+
+        // 空のエントリーを見つけた(そこまではkeyが合致していないので見つからなかったものとして終了)
+        // saveされたentryは世代が1以上なので、dataが0になることはない。
+        if (!data)
+          break;
+
+        if ((e.key_xor_data64.load(std::memory_order_relaxed) ^ data) == key64)
+        {
+          if (TTEntry::depth(data) >= depth)
+          {
+            depth = TTEntry::depth(data);
+            tt_move = TTEntry::move(data);
+            // Refresh
+            if (TTEntry::generation(data) != generation)
+              write(e, key64, TTEntry::make_data(depth, TTEntry::move(data), generation));
+            return true;
+          }
+          tt_move = TTEntry::move(data);
+          return false;
+        }
+      }
+      tt_move = MOVE_NONE;
+      return false;
+    }
+
+    void save(const Key128& key, uint32_t depth, Move move, uint16_t generation)
+    {
+      const uint64_t key64 = key.p(1);
+      TTEntry* replace = nullptr;
+      int32_t replace_value = INT32_MAX;
+
+      for (int i = 0; i < ClusterSize; ++i)
+      {
+        auto& e = entry[i];
+        const uint64_t data = e.data64.load(std::memory_order_relaxed);
+
+        // 空のentryがあったのでここに上書き
+        if (!data)
+        {
+          replace = &e;
+          break;
+        }
+
+        // 同じhash keyのentryがあったのでここ以外に書き込むわけにはいかない
+        if ((e.key_xor_data64.load(std::memory_order_relaxed) ^ data) == key64)
+        {
+          // 現在のdepthのほうが深いなら書き込まずに終了。たぶん他のスレッドが書き込んだのだろう。
+          if (TTEntry::depth(data) >= depth && depth != MATE_DEPTH)
+            return;
+          replace = &e;
+          break;
+        }
+
+        // 一致するentryも空のentryもなければreplace_score()の一番小さいものを犠牲にする。
+        const int32_t value = replace_score(TTEntry::depth(data), TTEntry::generation(data), generation);
+        if (value < replace_value)
+        {
+          replace = &e;
+          replace_value = value;
+        }
+      }
+
+      write(*replace, key64, TTEntry::make_data(depth, move, generation));
+    }
+
+    int count_generation(uint16_t generation) const
+    {
+      int cnt = 0;
+      for (int i = 0; i < ClusterSize; ++i)
+        if (TTEntry::generation(entry[i].data64.load(std::memory_order_relaxed)) == generation)
+          ++cnt;
+      return cnt;
+    }
+
+    // 書きかけのentryはkeyの照合に失敗するだけなので何もしなくて良い。
+    void recover() {}
+
+  private:
+    static void write(TTEntry& e, uint64_t key64, uint64_t data)
+    {
+      e.data64.store(data, std::memory_order_relaxed);
+      e.key_xor_data64.store(key64 ^ data, std::memory_order_relaxed);
+    }
+
+    TTEntry entry[ClusterSize];
+  };
+
+  // 1つのcache lineにentryを7つ詰め込んだ置換表のCluster。
+  // entryはkeyの代わりに32bitのtagを持ち、probe()では7つのtagをSIMD命令で一度に比較する。
+  // 各entryのフィールドはフィールドごとの配列にしてあり、tagの配列をそのままloadして比較できる。
+  //
+  // 排他はClusterごとの8bitのsequence counterによるseqlockで行なう。
+  //   書き込み : seqを偶数から奇数にできたときだけ書き込み、書き終えたら次の偶数にする。
+  //              他のスレッドが書き込み中であれば書き込み自体を諦める。(置換表への保存は必須ではないので)
+  //   読み出し : 読み出しの前後でseqが同じ偶数であったときだけ読み出した内容を信用する。
+  // よって読み出しも書き込みもspinすることはない。
+  //
+  // 照合に用いるkeyのbit数はtagの32bit(+indexに用いたbit)になるので、
+  // LockedCluster/LocklessClusterの64bitよりhash衝突の確率は高くなることに注意。
+  struct BucketCluster {
+
+    // 1クラスターにおけるentryの数
+    static const int ClusterSize = 7;
+    static const uint32_t Scheme = 3;
+
+    // depthは16bitで保持するので、MAX_PLYが16bitに収まっている必要がある。
+    static_assert(MAX_PLY <= 0xffff, "MAX_PLY must fit in 16 bits.");
+
+    // 引数と戻り値の意味はLockedCluster::probe()と同じ。
+    bool probe(const Key128& key, uint32_t& depth, Move& tt_move, uint16_t generation)
+    {
+      const uint32_t tag = make_tag(key);
+      const uint8_t s = seq.load(std::memory_order_acquire);
+
+      // 書き込み中であれば見つからなかったものとして扱う。
+      if (!(s & 1))
+      {
+        for (uint32_t mask = match(tag); mask; )
+        {
+          const int i = pop_lsb(mask);
+          const uint16_t d = depth16[i];
+          const Move m = (Move)move16[i];
+
+          // 空のentry(saveされたentryのdepthは1以上)
+          if (!d)
+            continue;
+
+          // 読み出している間に書き換わっていたら信用できない。
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if (seq.load(std::memory_order_relaxed) != s)
+            break;
+
+          if (d >= depth)
+          {
+            depth = d;
+            tt_move = m;
+            // Refresh
+            if (gen8[i] != (uint8_t)generation && try_lock(s))
+            {
+              gen8[i] = (uint8_t)generation;
+              unlock(s);
+            }
+            return true;
+          }
+          tt_move = m;
+          return false;
+        }
+      }
+      tt_move = MOVE_NONE;
+      return false;
+    }
+
+    void save(const Key128& key, uint32_t depth, Move move, uint16_t generation)
+    {
+      const uint32_t tag = make_tag(key);
+      uint8_t s = seq.load(std::memory_order_relaxed);
+      while ((s & 1) || !try_lock(s))
+      {
+        // 他のスレッドが書き込み中なら諦める。書き込めなくても探索が少し無駄になるだけ。
+        // ただしMATE_DEPTHは詰み手順の復元に必要なので、lockが取れるまで待って必ず書き込む。
+        if (depth != MATE_DEPTH)
+          return;
+        s = seq.load(std::memory_order_relaxed);
+      }
+
+      int replace = -1;
+
+      // 同じtagのentryがあったのでここ以外に書き込むわけにはいかない
+      for (uint32_t mask = match(tag); mask; )
+      {
+        const int i = pop_lsb(mask);
+        if (!depth16[i])
+          continue;
+
+        // 現在のdepthのほうが深いなら書き込まずに終了。たぶん他のスレッドが書き込んだのだろう。
+        if (depth16[i] >= depth && depth != MATE_DEPTH)
+        {
+          unlock(s);
+          return;
+        }
+        replace = i;
+        break;
+      }
+
+      if (replace < 0)
+      {
+        // 空のentryがあればそこ、なければreplace_score()の一番小さいものを犠牲にする。
+        // 世代は8bitしか持たないので、自分より未来の世代のために8を足しておく。
+        int32_t replace_value = INT32_MAX;
+        for (int i = 0; i < ClusterSize; ++i)
+        {
+          if (!depth16[i])
+          {
+            replace = i;
+            break;
+          }
+          const int32_t value = (int32_t)depth16[i] - (uint8_t)(8 + (uint8_t)generation - gen8[i]) * 8;
+          if (value < replace_value)
+          {
+            replace = i;
+            replace_value = value;
+          }
+        }
+      }
+
+      tag32[replace] = tag;
+      depth16[replace] = (uint16_t)depth;
+      move16[replace] = (uint16_t)move;
+      gen8[replace] = (uint8_t)generation;
+      unlock(s);
+    }
+
+    int count_generation(uint16_t generation) const
+    {
+      int cnt = 0;
+      for (int i = 0; i < ClusterSize; ++i)
+        if (depth16[i] && gen8[i] == (uint8_t)generation)
+          ++cnt;
+      return cnt;
+    }
+
+    // 書き込み中に異常終了したClusterは、中身が信用できないのでクリアする。
+    void recover()
+    {
+      if (seq.load() & 1)
+      {
+        memset(this, 0, offsetof(BucketCluster, seq));
+        seq = 0;
+      }
+    }
+
+  private:
+
+    // tagにはhash keyの上位bit側を使う。
+    static uint32_t make_tag(const Key128& key) { return (uint32_t)(key.p(1) >> 32); }
+
+    // tagが一致するentryのbitが立ったmaskを返す。
+    uint32_t match(uint32_t tag) const
+    {
+      // tag32[7]の直後にはdepth16[]があるが、その部分の比較結果は最後にmaskして捨てる。
+#ifdef USE_AVX2
+      const __m256i t = _mm256_set1_epi32((int)tag);
+      const __m256i cmp = _mm256_cmpeq_epi32(_mm256_load_si256((const __m256i*)tag32), t);
+      return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(cmp)) & ((1 << ClusterSize) - 1);
+#else
+      const __m128i t = _mm_set1_epi32((int)tag);
+      const __m128i cmp0 = _mm_cmpeq_epi32(_mm_load_si128((const __m128i*)tag32), t);
+      const __m128i cmp1 = _mm_cmpeq_epi32(_mm_load_si128((const __m128i*)tag32 + 1), t);
+      return ((uint32_t)_mm_movemask_ps(_mm_castsi128_ps(cmp0))
+        | ((uint32_t)_mm_movemask_ps(_mm_castsi128_ps(cmp1)) << 4)) & ((1 << ClusterSize) - 1);
+#endif
+    }
+
+    // seqがsのままであればs + 1(奇数)にして書き込み権を得る。
+    bool try_lock(uint8_t s) { return seq.compare_exchange_strong(s, (uint8_t)(s + 1), std::memory_order_acquire); }
+    void unlock(uint8_t s) { seq.store((uint8_t)(s + 2), std::memory_order_release); }
+
+    uint32_t tag32[ClusterSize];  // hash keyのtag
+    uint16_t depth16[ClusterSize];// この残り探索深さにおいて詰まない。0なら空のentry。
+    uint16_t move16[ClusterSize]; // 1手しかないときの指し手
+    uint8_t gen8[ClusterSize];    // 置換表の世代の下位8bit
+    std::atomic<uint8_t> seq;     // seqlock用のsequence counter
+    // 4*7 + 2*7 + 2*7 + 1*7 + 1 = 64
+  };
+
+  // entryを8byteに圧縮して、1つのcache lineに8entry詰め込んだ置換表のCluster。
+  // Clusterのindexがkeyの一部を表しているので、entryにはkeyの残りのbitからTagBitsだけをtagとして持つ。
+  // 世代もtagの残りのbit数(32 - TagBits)に縮める。
+  //   entryのbit layout
+  //     bit  0..15        : この残り探索深さにおいて詰まない。0なら空のentry。
+  //     bit 16..31        : 1手しかないときの指し手
+  //     bit 32..63-TagBits: 置換表の世代の下位bit
+  //     bit 64-TagBits..63: hash keyのtag
+  // TagBitsを増やせばhash衝突は減るが、世代のbit数が減るのでreplaceの精度は落ちる。
+  // どのくらい衝突するのかは"test cmtag"コマンドで調べられる。
+  // entryは64bitで一度に読み書きするので、lockなしでも壊れたentryが読み出されることはない。
+  template <int TagBits>
+  struct CompactCluster {
+
+    static_assert(16 <= TagBits && TagBits <= 30, "TagBits must be in [16,30].");
+    static_assert(MAX_PLY <= 0xffff, "MAX_PLY must fit in 16 bits.");
+
+    // 1クラスターにおけるentryの数
+    static const int ClusterSize = 8;
+    static const uint32_t Scheme = 0x100 + TagBits;
+
+    // 世代のbit数
+    static const int GenBits = 32 - TagBits;
+
+    // 引数と戻り値の意味はLockedCluster::probe()と同じ。
+    bool probe(const Key128& key, uint32_t& depth, Move& tt_move, uint16_t generation)
+    {
+      const uint64_t tag = make_tag(key);
+      for (int i = 0; i < ClusterSize; ++i)
+      {
+        const uint64_t e = entry[i].load(std::memory_order_relaxed);
+
+        // 空のエントリーを見つけた(そこまではkeyが合致していないので見つからなかったものとして終了)
+        if (!entry_depth(e))
+          break;
+
+        if ((e & TagMask) == tag)
+        {
+          if (entry_depth(e) >= depth)
+          {
+            depth = entry_depth(e);
+            tt_move = (Move)(uint16_t)(e >> 16);
+            // Refresh
+            const uint64_t g = make_gen(generation);
+            if ((e & GenMask) != g)
+              entry[i].store((e & ~GenMask) | g, std::memory_order_relaxed);
+            return true;
+          }
+          tt_move = (Move)(uint16_t)(e >> 16);
+          return false;
+        }
+      }
+      tt_move = MOVE_NONE;
+      return false;
+    }
+
+    void save(const Key128& key, uint32_t depth, Move move, uint16_t generation)
+    {
+      const uint64_t tag = make_tag(key);
+      int replace = 0;
+      int32_t replace_value = INT32_MAX;
+
+      for (int i = 0; i < ClusterSize; ++i)
+      {
+        const uint64_t e = entry[i].load(std::memory_order_relaxed);
+
+        // 空のentryがあったのでここに上書き
+        if (!entry_depth(e))
+        {
+          replace = i;
+          break;
+        }
+
+        // 同じtagのentryがあったのでここ以外に書き込むわけにはいかない
+        if ((e & TagMask) == tag)
+        {
+          // 現在のdepthのほうが深いなら書き込まずに終了。たぶん他のスレッドが書き込んだのだろう。
+          if (entry_depth(e) >= depth && depth != MATE_DEPTH)
+            return;
+          replace = i;
+          break;
+        }
+
+        // 一致するentryも空のentryもなければreplace_score()相当の値の一番小さいものを犠牲にする。
+        // 世代はGenBitsしか持たないので、自分より未来の世代のために1を足しておく。
+        const uint32_t age = (uint32_t)(((make_gen(generation) - (e & GenMask) + make_gen(1)) & GenMask) >> 32);
+        const int32_t value = (int32_t)entry_depth(e) - (int32_t)age * 8;
+        if (value < replace_value)
+        {
+          replace = i;
+          replace_value = value;
+        }
+      }
+
+      entry[replace].store(tag | make_gen(generation) | ((uint64_t)(uint16_t)move << 16) | (uint16_t)depth,
+        std::memory_order_relaxed);
+    }
+
+    int count_generation(uint16_t generation) const
+    {
+      int cnt = 0;
+      for (int i = 0; i < ClusterSize; ++i)
+      {
+        const uint64_t e = entry[i].load(std::memory_order_relaxed);
+        if (entry_depth(e) && (e & GenMask) == make_gen(generation))
+          ++cnt;
+      }
+      return cnt;
+    }
+
+    // entryは64bitで一度に書き込んでいるので書きかけのentryは存在しない。
+    void recover() {}
+
+  private:
+    static const uint64_t TagMask = ~UINT64_C(0) << (64 - TagBits);
+    static const uint64_t GenMask = ~TagMask & (~UINT64_C(0) << 32);
+
+    // tagにはhash keyの上位bit側を使う。
+    static uint64_t make_tag(const Key128& key) { return key.p(1) & TagMask; }
+    static uint64_t make_gen(uint16_t generation) { return ((uint64_t)generation << 32) & GenMask; }
+    static uint32_t entry_depth(uint64_t e) { return (uint16_t)e; }
+
+    std::atomic<uint64_t> entry[ClusterSize];
+  };
+
+  // 優等局面(手駒だけが異なり、手駒が優っている局面)の探索結果を使える置換表のCluster。
+  // 協力詰めでは、先手の手駒が多いほど指せる手(王手)が増えるだけなので、
+  // 先手の手駒がより多い局面でdepth手以内に詰まないなら、手駒が同じか少ない局面でもdepth手以内には詰まない。
+  // (後手の手駒は合駒に使えるので、多くても少なくても詰みやすくなるとは限らない。よって後手の手駒は一致していないといけない)
+  //
+  // keyは先手の手駒を除いたhash key(TTKey::key)で、先手の手駒だけが異なる局面は同じClusterに入る。
+  // entryにはtagのほかに先手の手駒(TTKey::hand)を持ち、
+  //   probe() : 手駒が一致するentry、または手駒が優っているentryでdepthが足りていれば枝刈りできる。
+  //             ただし指し手(1手しかないときの指し手、詰み手順の指し手)は手駒が一致するentryのものしか使えない。
+  //   save()  : 手駒が一致するentryがなければ、手駒が劣っていてdepthも浅いentry(新しいentryで代用できる)を優先して置き換える。
+  // 排他はBucketClusterと同じseqlock。
+  struct HandCluster {
+
+    // 1クラスターにおけるentryの数
+    static const int ClusterSize = 4;
+    static const uint32_t Scheme = 4;
+
+    static_assert(MATE_DEPTH <= 0xffff, "MATE_DEPTH must fit in 16 bits.");
+
+    // 引数と戻り値の意味はLockedCluster::probe()と同じ。
+    bool probe(const TTKey& key, uint32_t& depth, Move& tt_move, uint16_t generation)
+    {
+      const uint32_t tag = make_tag(key);
+      const uint8_t s = seq.load(std::memory_order_acquire);
+      Move move = MOVE_NONE;
+
+      // 書き込み中であれば見つからなかったものとして扱う。
+      if (!(s & 1))
+      {
+        int hit = -1;
+        for (int i = 0; i < ClusterSize; ++i)
+        {
+          const uint16_t d = depth16[i];
+          if (!d || tag32[i] != tag || d < depth)
+          {
+            // 深さは足りないが手駒が一致するentryなら指し手だけは使える。
+            if (d && tag32[i] == tag && hand32[i] == (uint32_t)key.hand)
+              move = (Move)move16[i];
+            continue;
+          }
+
+          // 手駒が一致するentryか、手駒が優っているentry。詰み手順のentryは手駒が一致していないと使えない。
+          if (hand32[i] == (uint32_t)key.hand
+            || (d != MATE_DEPTH && hand_is_equal_or_superior((Hand)hand32[i], key.hand)))
+          {
+            hit = i;
+            break;
+          }
+        }
+
+        // 読み出している間に書き換わっていたら信用できない。
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq.load(std::memory_order_relaxed) == s)
+        {
+          if (hit >= 0)
+          {
+            depth = depth16[hit];
+            tt_move = hand32[hit] == (uint32_t)key.hand ? (Move)move16[hit] : MOVE_NONE;
+            // Refresh
+            if (gen8[hit] != (uint8_t)generation && try_lock(s))
+            {
+              gen8[hit] = (uint8_t)generation;
+              unlock(s);
+            }
+            return true;
+          }
+          tt_move = move;
+          return false;
+        }
+      }
+      tt_move = MOVE_NONE;
+      return false;
+    }
+
+    void save(const TTKey& key, uint32_t depth, Move move, uint16_t generation)
+    {
+      const uint32_t tag = make_tag(key);
+      uint8_t s = seq.load(std::memory_order_relaxed);
+      while ((s & 1) || !try_lock(s))
+      {
+        // 他のスレッドが書き込み中なら諦める。書き込めなくても探索が少し無駄になるだけ。
+        // ただしMATE_DEPTHは詰み手順の復元に必要なので、lockが取れるまで待って必ず書き込む。
+        if (depth != MATE_DEPTH)
+          return;
+        s = seq.load(std::memory_order_relaxed);
+      }
+
+      int replace = -1;
+
+      // 手駒まで同じentryがあったのでここ以外に書き込むわけにはいかない
+      for (int i = 0; i < ClusterSize; ++i)
+        if (depth16[i] && tag32[i] == tag && hand32[i] == (uint32_t)key.hand)
+        {
+          // 現在のdepthのほうが深いなら書き込まずに終了。たぶん他のスレッドが書き込んだのだろう。
+          if (depth16[i] >= depth && depth != MATE_DEPTH)
+          {
+            unlock(s);
+            return;
+          }
+          replace = i;
+          break;
+        }
+
+      // 手駒が劣っていてdepthも浅いentryは、これから書き込むentryで代用できるので置き換える。
+      if (replace < 0 && depth != MATE_DEPTH)
+        for (int i = 0; i < ClusterSize; ++i)
+          if (depth16[i] && tag32[i] == tag && depth16[i] <= depth && depth16[i] != MATE_DEPTH
+            && hand_is_equal_or_superior(key.hand, (Hand)hand32[i]))
+          {
+            replace = i;
+            break;
+          }
+
+      if (replace < 0)
+      {
+        // 空のentryがあればそこ、なければreplace_score()の一番小さいものを犠牲にする。
+        // 世代は8bitしか持たないので、自分より未来の世代のために8を足しておく。
+        int32_t replace_value = INT32_MAX;
+        for (int i = 0; i < ClusterSize; ++i)
+        {
+          if (!depth16[i])
+          {
+            replace = i;
+            break;
+          }
+          const int32_t value = (int32_t)depth16[i] - (uint8_t)(8 + (uint8_t)generation - gen8[i]) * 8;
+          if (value < replace_value)
+          {
+            replace = i;
+            replace_value = value;
+          }
+        }
+      }
+
+      tag32[replace] = tag;
+      hand32[replace] = (uint32_t)key.hand;
+      depth16[replace] = (uint16_t)depth;
+      move16[replace] = (uint16_t)move;
+      gen8[replace] = (uint8_t)generation;
+      unlock(s);
+    }
+
+    int count_generation(uint16_t generation) const
+    {
+      int cnt = 0;
+      for (int i = 0; i < ClusterSize; ++i)
+        if (depth16[i] && gen8[i] == (uint8_t)generation)
+          ++cnt;
+      return cnt;
+    }
+
+    // 書き込み中に異常終了したClusterは、中身が信用できないのでクリアする。
+    void recover()
+    {
+      if (seq.load() & 1)
+      {
+        memset(this, 0, offsetof(HandCluster, seq));
+        seq = 0;
+      }
+    }
+
+  private:
+
+    // tagにはhash keyの上位bit側を使う。
+    static uint32_t make_tag(const TTKey& key) { return (uint32_t)(key.key.p(1) >> 32); }
+
+    bool try_lock(uint8_t s) { return seq.compare_exchange_strong(s, (uint8_t)(s + 1), std::memory_order_acquire); }
+    void unlock(uint8_t s) { seq.store((uint8_t)(s + 2), std::memory_order_release); }
+
+    uint32_t tag32[ClusterSize];  // hash key(先手の手駒を除く)のtag
+    uint32_t hand32[ClusterSize]; // 先手の手駒
+    uint16_t depth16[ClusterSize];// この残り探索深さにおいて詰まない。0なら空のentry。
+    uint16_t move16[ClusterSize]; // 1手しかないときの指し手
+    uint8_t gen8[ClusterSize];    // 置換表の世代の下位8bit
+    std::atomic<uint8_t> seq;     // seqlock用のsequence counter
+    uint8_t padding[11];
+    // 4*4 + 4*4 + 2*4 + 2*4 + 1*4 + 1 + 11 = 64
+  };
+
+  // 協力詰め用の置換表。ClusterはLockedCluster/LocklessCluster/BucketCluster/CompactCluster/HandClusterなど。
+  template <typename Cluster>
+  struct TranspositionTable {
+
+    // 局面posで置換表を引くときのkey。HandClusterなら先手の手駒を除いたhash keyと先手の手駒。
+    TTKey key(const Position& pos) const
+    {
+      return std::is_same<Cluster, HandCluster>::value
+        ? TTKey(pos.state()->long_key() - HandHash(BLACK, pos.hand_of(BLACK)), pos.hand_of(BLACK))
+        : TTKey(pos.state()->long_key());
+    }
+
+    // 置換表のなかから与えられたkeyに対応するentryを探す。
+    // 置換表により深いdepthのentryがあればそのdepthを引数のdepthに反映させてtrueを返す。
+    // 置換表により深いdepthのentryはなかったけどこのnodeのentryがあったならその指し手を
+    //   引数のtt_moveに反映させてfalseを返す。
+    // 置換表にこのnodeのentryが見つからない場合はfalseを返す。
+    // 詰み手順上の局面のentry(MATE_DEPTH)は見つからなかったものとして扱う。
+    bool probe(const TTKey& key, uint32_t& depth, Move& tt_move)
+    {
+      uint32_t d = depth;
+      if (!cluster(key).probe(key, d, tt_move, generation16))
+        return false;
+      if (d == MATE_DEPTH)
+      {
+        tt_move = MOVE_NONE;
+        return false;
+      }
+      depth = d;
+      return true;
+    }
+
+    void save(const TTKey& key, uint32_t depth, Move move)
+    {
+      cluster(key).save(key, depth, move, generation16);
+    }
+
+    // 詰み手順上の局面であることと、そこで詰みに至る指し手moveを記録する。
+    void save_mate(const TTKey& key, Move move)
+    {
+      cluster(key).save(key, MATE_DEPTH, move, generation16);
+    }
+
+    // save_mate()で記録した指し手を返す。なければMOVE_NONE。
+    Move probe_mate(const TTKey& key)
+    {
+      uint32_t depth = MATE_DEPTH;
+      Move move = MOVE_NONE;
+      return cluster(key).probe(key, depth, move, generation16) && depth == MATE_DEPTH ? move : MOVE_NONE;
     }
 
     // 置換表のサイズを変更する。mbSize == 確保するメモリサイズ。MB単位。
+    // ファイルに置く置換表の場合は、USIのoptionの設定順によってファイルの中身が捨てられないように、
+    // 実際にファイルにmapするのはprepare()まで遅延させる。
     void resize(size_t mbSize) {
-      free(mem);
+      hash_mb = mbSize;
+      if (hash_file.empty())
+        allocate();
+      else
+        need_mapping = true;
+    }
+
+    // 置換表を置くファイルを設定する。空の文字列ならばファイルには置かない。
+    // ファイルに置いた置換表は、プロセスが終了してもその中身が保存されていて、
+    // 次回に同じファイルを指定すればその中身を引き継いで探索できる。
+    void set_hash_file(const std::string& path)
+    {
+      if (hash_file != path)
+      {
+        hash_file = path;
+        resize(hash_mb);
+      }
+    }
+
+    // isreadyのときに呼び出される。
+    // ファイルに置く置換表であれば、ここでファイルにmapする。
+    // ファイルに置いた置換表は前回までの中身を引き継ぐのでクリアしない。そうでなければ呼び出し元でクリアする。(clear_hash())
+    void prepare()
+    {
+      if (need_mapping)
+        allocate();
+    }
+
+    // ファイルに置いた置換表であるか。
+    bool persistent() const { return header != nullptr; }
 
-      // 2のべき乗にはしない。entryCountは偶数であることだけ保証する。
+    // ファイルに置いた置換表の中身をファイルに書き出す。wait == falseなら書き出しの完了を待たない。
+    void flush(bool wait) { memory.flush(wait); }
+
+  private:
+    // hash_mbとhash_fileに従ってメモリを確保する。
+    void allocate()
+    {
+      // 2のべき乗にはしない。clusterCountは偶数であることだけ保証する。
       // 先手と後手との局面はhash keyの下位1bitで判別しているので、
-      // 先手用の局面と後手用の局面とでTTEntryは別のところになって欲しいから。
-      clusterCount = (mbSize * 1024 * 1024 / sizeof(Cluster)) & ~UINT64_C(1);
+      // 先手用の局面と後手用の局面とでTTEntryは別のところになって欲しいから。(cluster()を参照のこと)
+      clusterCount = (hash_mb * 1024 * 1024 / sizeof(Cluster)) & ~UINT64_C(1);
+      release_file();
+      loaded = false;
+      need_mapping = false;
+
+      if (!hash_file.empty())
+      {
+        // ファイルにmapする。ファイルが同じ形式の置換表であれば、その中身と世代を引き継ぐ。
+        char* p = (char*)memory.map_file(hash_file, TTFileHeader::HeaderSize + clusterCount * sizeof(Cluster));
+        if (p)
+        {
+          header = (TTFileHeader*)p;
+          table = (Cluster*)(p + TTFileHeader::HeaderSize);
+
+          TTFileHeader h;
+          h.init(clusterCount, sizeof(Cluster), Cluster::Scheme, key_fingerprint());
+          if (h.compatible(*header))
+          {
+            generation16 = header->generation;
+            loaded = true;
+
+            // 前回のプロセスが置換表に書き込み中に異常終了していた。
+            if (header->dirty)
+            {
+              for (size_t i = 0; i < clusterCount; ++i)
+                table[i].recover();
+              std::cout << "info string CM_HashFile " << hash_file << " was not closed properly. recovered." << std::endl;
+            }
+          } else {
+            // 形式が異なるなら中身は使えないのでクリアする。
+            *header = h;
+            header->generation = generation16;
+            clear();
+          }
+          header->dirty = 1;
+          return;
+        }
+        std::cout << "info string failed to map CM_HashFile " << hash_file << std::endl;
+      }
 
-      mem = calloc(clusterCount * sizeof(Cluster) + CacheLineSize - 1, 1);
-      if (!mem)
+      table = (Cluster*)memory.alloc(clusterCount * sizeof(Cluster), CacheLineSize, numa_interleave);
+      if (!table)
       {
-        std::cout << "failed to calloc\n";
+        std::cout << "failed to allocate CM_Hash\n";
         exit(EXIT_FAILURE);
       }
-      table = (Cluster*)((uintptr_t(mem) + CacheLineSize - 1) & ~(CacheLineSize - 1));
+    }
+
+  public:
+
+    // 置換表のメモリをNUMA nodeをまたいでinterleaveして配置するかを設定する。
+    // falseならば、clear()したスレッドのnodeに配置される。(first-touch)
+    void set_numa_interleave(bool interleave)
+    {
+      if (numa_interleave != interleave)
+      {
+        numa_interleave = interleave;
+        if (!persistent())
+          resize(hash_mb);
+      }
     }
 
     // 置換表のエントリーの全クリア
-    void clear() { memset(table, 0, clusterCount * sizeof(Cluster)); }
+    void clear() { clear_slice(0, 1); }
+
+    // 置換表をthread_num個に分けたうちのi番目をクリアする。
+    // NUMA環境では、interleaveしていなければメモリは最初に書き込んだスレッドのnodeに配置される(first-touch)ので、
+    // 探索スレッドがそれぞれ自分の分を呼び出して、各nodeに分散させる。(clear_hash())
+    void clear_slice(size_t i, size_t thread_num)
+    {
+      const size_t size = clusterCount * sizeof(Cluster);
+      const size_t chunk = (size / thread_num + CacheLineSize - 1) & ~(size_t)(CacheLineSize - 1);
+      if (i * chunk < size)
+        memset((char*)table + i * chunk, 0, std::min(chunk, size - i * chunk));
+    }
+
+    // 置換表のサイズとメモリのpageの種類。"info string"での表示用。
+    std::string info() const
+    {
+      return "CM_Hash " + std::to_string(hash_mb) + "MB , " + memory.page_info()
+        + (loaded ? " , loaded (generation " + std::to_string(generation16) + ")" : "");
+    }
+
+    // 置換表の世代
+    uint16_t generation() const { return generation16; }
 
     // 世代カウンターをインクリメントする。
-    void new_search() { ++generation16; }
+    // entryの空き判定に世代を用いるClusterがあるので0にはしない。
+    void new_search()
+    {
+      if (++generation16 == 0)
+        ++generation16;
+      if (header)
+        header->generation = generation16;
+    }
 
     // 置換表使用率を調べる。世代が同じエントリーの数をサンプリングして調べる。
     int hashfull() const
@@ -171,72 +1060,135 @@ namespace CooperativeMate
       // すべてのエントリーにアクセスすると時間が非常にかかるため、先頭から1000エントリーだけ
       // サンプリングして使用されているエントリー数を返す。
       int cnt = 0;
-      for (int i = 0; i < 1000 / ClusterSize; ++i)
-      {
-        const auto tte = &table[i].entry[0];
-        for (int j = 0; j < ClusterSize; ++j)
-          if ((tte[j].generation() == generation16))
-            ++cnt;
-      }
-      return cnt;
+      for (int i = 0; i < 1000 / Cluster::ClusterSize; ++i)
+        cnt += table[i].count_generation(generation16);
+      return cnt * 1000 / (1000 / Cluster::ClusterSize * Cluster::ClusterSize);
     }
 
-    TranspositionTable() { mem = nullptr; generation16 = 0; resize(16); }
-    ~TranspositionTable() { free(mem); }
+    TranspositionTable() { generation16 = 0; numa_interleave = false; header = nullptr; loaded = false; need_mapping = false; resize(16); }
+    ~TranspositionTable() { release_file(); }
 
     // CPUのcache line size(この単位でClusterを配置しないといけない)
-    const int CacheLineSize = 64;
-
-    // 1クラスターにおけるTTEntryの数
-    static const int ClusterSize = 4;
+    static const int CacheLineSize = 64;
 
-    struct Cluster {
-      TTEntry entry[ClusterSize];
-    };
+    static_assert(sizeof(Cluster) == CacheLineSize, "Cluster size incorrect");
+    static_assert(TTFileHeader::HeaderSize % CacheLineSize == 0, "HeaderSize must be a multiple of CacheLineSize.");
 
-    void lock(Cluster& cluster)
+  private:
+    // ファイルに置いた置換表を正常に開放したことをheaderに記録する。
+    void release_file()
     {
-      // このClusterの1つ目のTTEntry::lockをこのClusterのlock用に使う。
-      auto& lk = cluster.entry[0].lock;
-      while (true)
+      if (header)
       {
-        uint8_t expected = 0;
-        if (lk.compare_exchange_weak(expected, 1))
-          break;
-        // 0なら1にして、これができたらlockできたとみなす。
+        memory.flush(true);
+        header->dirty = 0;
+        memory.flush(true);
+        header = nullptr;
       }
     }
-    void unlock(Cluster& cluster)
+
+    // keyに対応するClusterを返す。
+    // 剰余(%)は遅いので、keyの上位bitとclusterCount/2との積の上位64bitをindexにする。(multiply-high)
+    // 先手と後手との局面が別のClusterになるように、手番を表すkeyの下位1bitをindexの下位1bitにする。
+    Cluster& cluster(const Key128& key)
     {
-      auto& lk = cluster.entry[0].lock;
-      uint8_t expected = 1;
-      // 自分がlockしたのだから1になっているはず..
-      if (!lk.compare_exchange_weak(expected, 0))
-        ASSERT_LV1(false);
+      const uint64_t k = key.p(0);
+      return table[(mul_hi64(k, clusterCount >> 1) << 1) | (k & 1)];
     }
 
     // 確保されているClusterの先頭
     Cluster* table;
-    // callocで確保したもの。64byteでalignしたのが↑のtable
-    void* mem;
+    // OSから確保したメモリ。64byteでalignしたのが↑のtable
+    LargeMemory memory;
 
     size_t clusterCount;
-    int16_t generation16;
+    size_t hash_mb;
+    bool numa_interleave;
+    uint16_t generation16;
+
+    // 置換表を置くファイル名。空ならファイルには置かない。
+    std::string hash_file;
+    // ファイルに置いているときのheader。ファイルに置いていなければnullptr。
+    TTFileHeader* header;
+    // ファイルから前回の置換表の中身を引き継いだか。
+    bool loaded;
+    // prepare()でファイルにmapする必要があるか。
+    bool need_mapping;
   };
 
+  // 協力詰め用の置換表で用いるClusterの種類。
+  //   LockedCluster   : Clusterごとにspin lockを取る。スレッド数が多いとlockの競合で遅くなる。
+  //   LocklessCluster : lockを取らず、key ^ dataによる照合で壊れたentryを検出する。
+  //   BucketCluster   : 64byteに7entry。32bitのtagをSIMDで比較する。同じメモリでより多くの局面を保持できる。
+  //   CompactCluster<TagBits> : 64byteに8entry。tagはTagBits。hash衝突が許容できるなら最も多くの局面を保持できる。
+  //   HandCluster     : 64byteに4entry。先手の手駒が優っている局面の不詰めの結果も使える。駒打ちの多い問題向け。
+#ifdef CM_HAND_DOMINANCE
+  typedef HandCluster TTCluster;
+#else
+  typedef BucketCluster TTCluster;
+#endif
+
   // 協力詰めを解く。反復深化のループ。
   // thread_id : 0...thread_num-1
   // thread_num : スレッド数
   void id_loop(Position& root,int thread_id,int thread_num);
 
-  // 協力詰め関係の初期化
-  void init();
+  // 1スレッドで、残り探索深さmax_depthまで反復深化する。探索ノード数を返す。
+  // 詰みを見つけたらmate_lengthにその手数、見つからなければ0を返す。
+  // recursive == trueなら再帰版、falseなら非再帰版(id_loop()で使うほう)の探索を用いる。("test cmsearch"用)
+  uint64_t id_search(Position& pos, uint32_t max_depth, bool recursive, uint32_t& mate_length);
+
+  // 協力詰め関係の初期化。go mateのときに、探索開始前にmain threadから呼び出される。
+  void init(const Position& root);
+
+  // checkpointファイルを読み込んで、次のgo mateでそこから探索を再開するように設定する。
+  // sfenにはcheckpointを書き出したときの探索開始局面が返る。
+  // 読み込めなかったらfalseを返す。
+  bool load_checkpoint(const std::string& path, std::string& sfen);
+
+  // 詰みを見つけたあと、CM_Solutionsが1以外なら同じ手数の別解の列挙を準備してtrueを返す。
+  // trueが返ったら、各スレッドでenumerate()を呼び出して列挙する。main threadから呼び出される。
+  bool start_enumeration(Position& root);
+
+  // 別解を列挙する。最初に見つけた解と同じ手数の手順をすべて(CM_Solutionsの数まで)探す。
+  void enumerate(Position& root);
+
+  // 別解の列挙中であるか
+  extern bool enumerating;
+
+  // 残り探索深さがこれ以上の局面では、指し手を並べ替える。0なら並べ替えない。
+  // init()でCM_OrderDepthから設定される。("test cmorder"では直接書き換える)
+  extern uint32_t order_depth;
+
+  // 残り探索深さがこれ以上の局面では、historyとcounter moveで指し手を並べ替える。0なら使わない。
+  // init()でCM_HistoryDepthから設定される。("test cmhistory"では直接書き換える)
+  extern uint32_t history_depth;
+
+  // 末端の局面の詰み判定をbitboardで行うか。init()でCM_LeafSolverから設定される。("test cmleaf"では直接書き換える)
+  extern bool leaf_solver;
+
+  // 先手番の局面で後手玉を1手で詰ませる指し手を返す。なければMOVE_NONE。
+  // replyCountに合法な王手の数、oneReplyに最後の合法な王手が返る。ttMoveがあればそれだけを調べる。
+  Move leaf_mate1(Position& pos, Move ttMove, int& replyCount, Move& oneReply);
 
   // 全スレッド終了後にmain threadから呼び出される。
   void finalize();
 
+  // 置換表をクリアする。探索スレッド(Threads)で分担して、置換表のメモリを各スレッドのNUMA nodeに配置する。
+  // 探索中でないときにUSIのスレッドから呼び出す。
+  void clear_hash();
+
+  // clear_hash()の最中であるか。MainThread::think()とThread::search()は、探索の代わりにclear_hash_slice()を呼び出す。
+  extern bool clearing_hash;
+
+  // 置換表をスレッド数で分けたうち、thread_id番目をクリアする。
+  void clear_hash_slice(size_t thread_id);
+
+  // sfenのファイルを1問ずつ解いて、結果をJSON Lines形式で書き出す。USIの"cmbatch"コマンド。
+  void batch(std::istringstream& is);
+
   // 協力詰め用のglobalな置換表。
-  extern TranspositionTable TT;
+  extern TranspositionTable<TTCluster> TT;
 
 } // end of namespace
 
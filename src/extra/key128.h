@@ -48,6 +48,7 @@ struct Key128
   Key128 operator * (const int64_t i) const { return Key128(*this) *= i; }
 
   Key128 operator + (const Key128& rhs) const { return Key128(*this) += rhs; }
+  Key128 operator - (const Key128& rhs) const { return Key128(*this) -= rhs; }
   Key128 operator ^ (const Key128& rhs) const { return Key128(*this) ^= rhs; }
 
 };
@@ -79,6 +80,7 @@ struct Key256
   Key256 operator * (const int64_t i) const { return Key256(*this) *= i; }
 
   Key256 operator + (const Key256& rhs) const { return Key256(*this) += rhs; }
+  Key256 operator - (const Key256& rhs) const { return Key256(*this) -= rhs; }
   Key256 operator ^ (const Key256& rhs) const { return Key256(*this) ^= rhs; }
 
 };
@@ -3,26 +3,28 @@
 
 // 超高速1手詰め判定ライブラリ
 // cf. 新規節点で固定深さの探索を併用するdf-pnアルゴリズム gpw05.pdf
+//
+// 1手詰め判定に用いる利きの数(Position::effect)と長い利き(Position::long_effect)の差分更新もここで行う。
 
 #ifdef MATE_1PLY
 
 namespace {
 
-  // 方角を表す。遠方駒の利きや、玉から見た方角を表すのに用いる。
-  // bit0..左上、bit1..上、bit2..右上、bit3..左、bit4..右、bit5..左下、bit6..下、bit7..右下
-  enum Directions : uint8_t {
-    DIRECTIONS_LU = 1 , DIRECTIONS_U  = 2  , DIRECTIONS_RU = 4  , DIRECTIONS_L = 8 ,
-    DIRECTIONS_R=16   , DIRECTIONS_LD = 32 , DIRECTIONS_D  = 64 , DIRECTIONS_RD = 128 };
-  const int DIRECTIONS_NB = 256; // ↑のenumで表現できない範囲なので出しておく。
-
   // 方角 (Directionsをpopしたもの)
-  enum Direct { DIRECT_NB = 8 };
-  inline bool is_ok(Direct d) { return 0 <= d && d < DIRECT_NB; }
+  // Square型の差分値で表すと、DELTA_SE,DELTA_E,DELTA_NE,DELTA_S,DELTA_N,DELTA_SW,DELTA_W,DELTA_NWの順。
+  enum Direct { DIRECT_RU, DIRECT_R, DIRECT_RD, DIRECT_U, DIRECT_D, DIRECT_LU, DIRECT_L, DIRECT_LD, DIRECT_NB };
   inline Direct pop_directions(uint32_t& d) { return (Direct)pop_lsb(d); }
 
-  // DirectをSquare型の差分値で表現したもの
-  const Square DirectToDelta_[DIRECT_NB] = { DELTA_SW,DELTA_S,DELTA_SE,DELTA_W,DELTA_E,DELTA_NW,DELTA_N,DELTA_NE };
-  inline Square DirectToDelta(Direct d) { ASSERT_LV3(is_ok(d));  return DirectToDelta_[d]; }
+  // sqからdの方向に1升進んだ升。盤外ならSQ_NB。
+  // Square型は9升ごとに筋が変わるので、差分値を足すだけだと盤の端で隣の筋に回り込んでしまう。そのためのテーブル。
+  Square SquareDirect[SQ_NB_PLUS1][DIRECT_NB];
+
+  // 駒pcの長い利きの方向。(Directions) 馬・龍の1升だけの利きは含まない。
+  uint8_t LongDirections[PIECE_NB];
+
+  // 駒pcをsqに置いたときの、長い利き以外の利きがある升。(最大8升、SQ_NBで終端)
+  // 利きの差分更新はdo_move()ごとに何度も行うので、Bitboardから升を取り出すのではなくテーブルを引く。
+  uint8_t ShortEffectSquares[PIECE_NB][SQ_NB][9];
 
   // 1手詰め判定高速化テーブル
   struct alignas(8) MateInfo
@@ -37,196 +39,408 @@ namespace {
   };
 
   // 添字として
-  //  bit  0.. 8 : (1) 駒を打つ候補の升(受け方の利きがなく、攻め方の利きがある升) 壁の扱いは0でも1でも問題ない。
-  //  bit  9..15 : (2) 王が移動可能な升(攻め方の利きがなく、受け方の駒もない) 壁は0(玉はそこに移動できないので)
+  //  bit  0.. 7 : (1) 駒を打つ候補の升(空いていて、攻め方の利きがあり、受け方の利きが玉だけの升)
+  //  bit  8..15 : (2) 王が移動可能な升(攻め方の利きがなく、受け方の駒もない) 盤外は0(玉はそこに移動できないので)
   // を与えて、そのときに詰ませられる候補の駒種(HandKind)を返すテーブル。
-  // ただし、歩は打ち歩詰めになるので、移動させることが前提。桂は打つ先の升に敵の利きがないことが前提。
+  // ただし、歩は打ち歩詰めになるので除外。桂は(2)が0のときに候補とする。(打つ先の升に敵の利きがないことは別に調べる)
   MateInfo  mate1ply_drop_tbl[0x10000][COLOR_NB];
 
-  // 玉から見て、dの方向(Directionsの値をpop_lsb()したもの)にpcを置いたときに
-  // 大駒の利きを遮断してしまう利きの方向。(遮断しても元の駒の利きがそこに到達しているならそれは遮断しているとはみなさない)
-  Directions cutoff_directions[PIECE_NB][8];
+  // 玉の周囲の相対座標(筋,段)。玉が(0,0)。筋は左が+、段は下が+。
+  const int DirectFile[DIRECT_NB] = { -1,-1,-1, 0, 0,+1,+1,+1 };
+  const int DirectRank[DIRECT_NB] = { -1, 0,+1,-1,+1,-1, 0,+1 };
+
+  // 玉の周囲(dir)に置いた駒pcが、玉の周囲の升(target)か玉の升(target == DIRECT_NB)に利いているか。
+  // 長い利きは、隣の升か、玉の升を通り抜けた先の升までとする。(玉の周囲の他の升に駒があるかどうかはわからないので)
+  // 玉が逃げると玉の升はもう利きを遮らないので、玉の升の先にも利いていることになる。
+  bool drop_covers(Piece pc, Direct dir, int target)
+  {
+    const int df = (target == DIRECT_NB ? 0 : DirectFile[target]) - DirectFile[dir];
+    const int dr = (target == DIRECT_NB ? 0 : DirectRank[target]) - DirectRank[dir];
+    if (df == 0 && dr == 0)
+      return false;
+
+    // 先手の駒として判定する。(後手の駒は段を反転させる)
+    const int r = color_of(pc) == BLACK ? dr : -dr;
+    const int adf = abs(df), ar = abs(r);
+    switch (type_of(pc))
+    {
+    case SILVER: return adf <= 1 && ar == 1 && !(adf == 0 && r == 1);
+    case GOLD:   return adf <= 1 && ar <= 1 && !(adf == 1 && r == 1);
+    case LANCE:
+    case BISHOP:
+    case ROOK:
+    {
+      // 長い利きの方向に2升以上離れているなら、間の升が玉の升でなければならない。
+      const bool aligned = type_of(pc) == LANCE ? (df == 0 && r < 0)
+        : type_of(pc) == BISHOP ? (adf == ar) : (df == 0 || r == 0);
+      const int n = std::max(adf, ar);
+      if (!aligned)
+        return false;
+      if (n == 1)
+        return true;
+      return n == 2 && DirectFile[dir] + df / 2 == 0 && DirectRank[dir] + dr / 2 == 0;
+    }
+    default: UNREACHABLE; return false;
+    }
+  }
 }
 
-#ifdef USE_AVX2
-using ymm = __m256i;
-static const ymm ymm_zero = _mm256_setzero_si256();
-static const ymm ymm_one = _mm256_set1_epi8(1);
-#endif
+// --- ByteBoard
 
-// 利きの数や遠方駒の利きを表現するByteBoard
-struct ByteBoard
+uint8_t ByteBoard::around8(Square sq) const
 {
-  // ある升の利きの数
-  uint8_t count(Square sq) const { return e[sq+ array_offset]; }
-
-  // ある升にある長い利きの方向
-  Directions directions(Square sq) const { return (Directions)e[sq + array_offset]; }
-
-  // ゼロクリア
-  void clear() { memset(e, 0, 128); }
-
-  // ある升の周辺8近傍の利きを取得。1以上の値のところが1になる。壁のところは0になる。
-  uint8_t around8(Square sq) const {
-#ifdef USE_AVX2
-    ymm y0 = _mm256_load_si256((__m256i*)&e[sq + array_offset - 10]);
-    ymm mask0 = _mm256_cmpgt_epi8(y0, ymm_zero);
-    uint32_t m0 = _mm256_movemask_epi8(mask0); // sqの升の右上の升から32升分は取得できたので、これをPEXTで回収する。
-    return PEXT32(m0, 0b111000000101000000111);
-#else
-    uint8_t a8 = 0;
-    if (e[sq + array_offset - 10]) a8 |=   1;
-    if (e[sq + array_offset -  9]) a8 |=   2;
-    if (e[sq + array_offset -  8]) a8 |=   4;
-    if (e[sq + array_offset -  1]) a8 |=   8;
-    if (e[sq + array_offset +  1]) a8 |=  16;
-    if (e[sq + array_offset +  8]) a8 |=  32;
-    if (e[sq + array_offset +  9]) a8 |=  64;
-    if (e[sq + array_offset + 10]) a8 |= 128;
-    return (uint8_t)a8;
-#endif
+  uint8_t a8 = 0;
+  for (int d = 0; d < DIRECT_NB; ++d)
+    if (e[SquareDirect[sq][d]])
+      a8 |= 1 << d;
+  return a8;
+}
+
+uint8_t ByteBoard::around8_larger_than_one(Square sq) const
+{
+  uint8_t a8 = 0;
+  for (int d = 0; d < DIRECT_NB; ++d)
+    if (e[SquareDirect[sq][d]] > 1)
+      a8 |= 1 << d;
+  return a8;
+}
+
+// --- 初期化
+
+void Mate1Ply::init()
+{
+  // SquareDirect
+  for (auto sq : SQ)
+    for (int d = 0; d < DIRECT_NB; ++d)
+    {
+      const int f = file_of(sq) + DirectFile[d], r = rank_of(sq) + DirectRank[d];
+      SquareDirect[sq][d] = (0 <= f && f < FILE_NB && 0 <= r && r < RANK_NB) ? (File)f | (Rank)r : SQ_NB;
+    }
+  for (int d = 0; d < DIRECT_NB; ++d)
+    SquareDirect[SQ_NB][d] = SQ_NB;
+
+  // ShortEffectSquares
+  for (Piece pc = NO_PIECE; pc < PIECE_NB; ++pc)
+    for (auto sq : SQ)
+    {
+      Bitboard bb = ZERO_BB;
+      switch (type_of(pc))
+      {
+      case NO_PIECE: case LANCE: case BISHOP: case ROOK: case PRO_GOLD: break;
+      case HORSE: bb = cross00StepEffect(sq); break;
+      case DRAGON: bb = cross45StepEffect(sq); break;
+      default: bb = effects_from(pc, sq, ZERO_BB); break;
+      }
+      int n = 0;
+      while (bb)
+        ShortEffectSquares[pc][sq][n++] = (uint8_t)bb.pop();
+      ShortEffectSquares[pc][sq][n] = SQ_NB;
+    }
+
+  // LongDirections
+  for (auto c : COLOR)
+  {
+    const uint8_t diag = DIRECTIONS_RU | DIRECTIONS_RD | DIRECTIONS_LU | DIRECTIONS_LD;
+    const uint8_t cross = DIRECTIONS_R | DIRECTIONS_U | DIRECTIONS_D | DIRECTIONS_L;
+    LongDirections[make_piece(LANCE, c)] = c == BLACK ? DIRECTIONS_U : DIRECTIONS_D;
+    LongDirections[make_piece(BISHOP, c)] = LongDirections[make_piece(HORSE, c)] = diag;
+    LongDirections[make_piece(ROOK, c)] = LongDirections[make_piece(DRAGON, c)] = cross;
   }
 
-  // ある升の周辺8近傍の利きを取得。2以上の値のところが1になる。壁のところは0になる。
-  uint8_t around8_larger_than_two(Square sq)
+  // mate1ply_drop_tbl
+  for (uint32_t info = 0; info < 0x10000; ++info)
+    for (auto c : COLOR)
+    {
+      auto& mi = mate1ply_drop_tbl[info][c];
+      const uint32_t drop_cand = info & 0xff, movable = info >> 8;
+      mi = MateInfo();
+
+      for (Piece pt : { LANCE, SILVER, GOLD, BISHOP, ROOK })
+      {
+        const Piece pc = make_piece(pt, c);
+        uint8_t directions = 0;
+        for (int d = 0; d < DIRECT_NB; ++d)
+        {
+          if (!(drop_cand & (1 << d)) || !drop_covers(pc, (Direct)d, DIRECT_NB))
+            continue;
+
+          // 王手になっていて、玉が移動可能な升にすべて利いていれば詰み。
+          bool mate = true;
+          for (int e = 0; e < DIRECT_NB; ++e)
+            if ((movable & (1 << e)) && !drop_covers(pc, (Direct)d, e))
+              mate = false;
+          if (mate)
+            directions |= 1 << d;
+        }
+        mi.directions[pt] = (Directions)directions;
+      }
+
+      uint8_t hk = 0;
+      for (Piece pt : { LANCE, SILVER, GOLD, BISHOP, ROOK })
+        if (mi.directions[pt])
+          hk |= 1 << (pt - 1);
+      if (!movable)
+        hk |= HAND_KIND_KNIGHT;
+      mi.hand_kind = hk;
+    }
+}
+
+// --- 利きの差分更新
+
+namespace {
+
+  // 盤面boardのsqに置かれた駒pcの利きを、s == +1なら足し、s == -1なら引く。
+  void add_effect(const Piece* board, ByteBoard* effect, ByteBoard* long_effect, Piece pc, Square sq, int s)
   {
-#ifdef USE_AVX2_
-    ymm y0 = _mm256_load_si256((__m256i*)&e[sq + array_offset - 10]);
-    ymm mask0 = _mm256_cmpgt_epi8(y0, ymm_one);
-    uint32_t m0 = _mm256_movemask_epi8(mask0); // sqの升の右上の升から32升分は取得できたので、これをPEXTで回収する。
-    return PEXT32(m0, 0b111000000101000000111);
-#else
-    uint8_t a8 = 0;
-    if (e[sq + array_offset - 10] > 1 ) a8 |=   1;
-    if (e[sq + array_offset - 9]  > 1 ) a8 |=   2;
-    if (e[sq + array_offset - 8]  > 1 ) a8 |=   4;
-    if (e[sq + array_offset - 1]  > 1 ) a8 |=   8;
-    if (e[sq + array_offset + 1]  > 1 ) a8 |=  16;
-    if (e[sq + array_offset + 8]  > 1 ) a8 |=  32;
-    if (e[sq + array_offset + 9]  > 1 ) a8 |=  64;
-    if (e[sq + array_offset + 10] > 1 ) a8 |= 128;
-    return (uint8_t)a8;
-#endif
+    const Color c = color_of(pc);
+
+    for (auto p = ShortEffectSquares[pc][sq]; *p != SQ_NB; ++p)
+      effect[c].e[*p] += s;
+
+    uint32_t dirs = LongDirections[pc];
+    while (dirs)
+    {
+      const Direct d = pop_directions(dirs);
+      for (Square to = SquareDirect[sq][d]; to != SQ_NB; to = SquareDirect[to][d])
+      {
+        effect[c].e[to] += s;
+        long_effect[c].e[to] ^= 1 << d;
+        if (board[to] != NO_PIECE)
+          break;
+      }
+    }
   }
+}
 
-  // --- 各升の利きの数
+void Position::update_effect(Piece pc, Square sq, int s)
+{
+  add_effect(board, effect, long_effect, pc, sq, s);
+}
 
-  static const int array_offset = 16;
-  static const int array_size = 128;
+void Position::update_long_effect(Square sq, int s)
+{
+  for (auto c : COLOR)
+  {
+    uint32_t dirs = long_effect[c].e[sq];
+    while (dirs)
+    {
+      const Direct d = pop_directions(dirs);
+      for (Square to = SquareDirect[sq][d]; to != SQ_NB; to = SquareDirect[to][d])
+      {
+        effect[c].e[to] += s;
+        long_effect[c].e[to] ^= 1 << d;
+        if (board[to] != NO_PIECE)
+          break;
+      }
+    }
+  }
+}
+
+void Position::set_effect()
+{
+  for (auto c : COLOR)
+  {
+    effect[c].clear();
+    long_effect[c].clear();
+  }
+  for (auto sq : pieces())
+    update_effect(piece_on(sq), sq, +1);
+}
+
+bool Position::effect_is_ok() const
+{
+  ByteBoard e[COLOR_NB], le[COLOR_NB];
+  for (auto c : COLOR)
+  {
+    e[c].clear();
+    le[c].clear();
+  }
+  for (auto sq : pieces())
+    add_effect(board, e, le, piece_on(sq), sq, +1);
+  return !std::memcmp(e, effect, sizeof(effect)) && !std::memcmp(le, long_effect, sizeof(long_effect));
+}
 
-  // SQ_NB + offset + offset。= SQ_11に対して 8近傍や桂の場所の利きを取ってきたいのでこんなレイアウト。
-  uint8_t e[array_size]; // [sq + offset] のようにして使う。
+// --- 1手詰め判定
 
-};
+namespace {
 
-// 各升の利きの数
-ByteBoard effect[COLOR_NB];
+  // 攻め方の駒をfromからtoにpcとして移動させたとき、受け方の玉が詰むか。pcで受け方の玉に王手がかかる(近接王手 or 桂の王手)ものとする。
+  // 合駒はできないので、toの駒を玉以外で取れず、玉の移動先(toを含む)がすべて攻め方の利きに入っていれば詰み。
+  // 受け方のpinされている駒もtoの駒を取れるものとして扱う。(詰みを見逃すことはあるが、誤って詰みとすることはない)
+  bool mate_by_move(const Position& pos, Square from, Square to, Piece pc, const Bitboard& pinned)
+  {
+    const Color us = color_of(pc), them = ~us;
+    const Square ksq = pos.king_square(them);
+
+    // 自玉が素抜きに合わないか
+    if (pos.discovered(from, to, pos.king_square(us), pinned))
+      return false;
+
+    // 受け方が玉以外の駒でtoの駒を取れないか
+    if (pos.attackers_to(them, to, (pos.pieces() ^ from) | to) & ~Bitboard(ksq))
+      return false;
+
+    // 玉の移動先がすべて攻め方の利きに入っているか。玉は取り除いて調べる。(toの駒の利きの延長線上に逃げられないように)
+    const Bitboard occ = ((pos.pieces() ^ from) | to) ^ ksq;
+    Bitboard escape = kingEffect(ksq) & ~(pos.pieces(them) & ~Bitboard(to)) & ~effects_from(pc, to, occ);
+    while (escape)
+      if (!(pos.attackers_to(us, escape.pop(), occ) & ~Bitboard(from)))
+        return false;
+    return true;
+  }
 
-// 長い利き。
-ByteBoard long_effect[COLOR_NB];
+  // toに駒pcを打ったときに、toを通過していた攻め方の長い利きが遮られて、玉の逃げ道ができるか。
+  bool drop_cuts_off(const Position& pos, Square to, Piece pc)
+  {
+    const Color us = color_of(pc), them = ~us;
+    const Square ksq = pos.king_square(them);
+    const auto& effect = pos.board_effect(us);
+    const Bitboard around = kingEffect(ksq) & ~pos.pieces(them) & ~effects_from(pc, to, (pos.pieces() | to) ^ ksq);
+
+    uint32_t dirs = pos.long_effect_of(us).directions(to);
+    while (dirs)
+    {
+      const Direct d = pop_directions(dirs);
+      for (Square sq = SquareDirect[to][d]; sq != SQ_NB; sq = SquareDirect[sq][d])
+      {
+        // 遮られる利きしか利いていなかった玉の周囲の升
+        if ((around & sq) && effect.count(sq) <= 1)
+          return true;
+        if (pos.piece_on(sq) != NO_PIECE)
+          break;
+      }
+    }
+    return false;
+  }
+}
 
 // 超高速1手詰め判定。
-//  info : mate1ply_drop_tbl[]のindex
 template <Color Us>
 Move Position::mate1ply_impl() const
 {
-  Square from, to;
+  const Color them = ~Us;
+  const Square themKing = king_square(them);
+
+  // 自玉に王手がかかっているなら、王手を回避しない指し手になりかねないので調べない。
+  if (in_check() || themKing == SQ_NB)
+    return MOVE_NONE;
 
   // --- 駒打ちによる詰み
+
+  // mate1ply_drop_tbl[]のindex
   uint32_t info = 0;
+  for (int d = 0; d < DIRECT_NB; ++d)
+  {
+    const Square sq = SquareDirect[themKing][d];
+    if (sq == SQ_NB)
+      continue;
+    // (1) 駒を打つ候補の升(受け方の利きは玉の1つだけ)
+    if (board[sq] == NO_PIECE && effect[Us].count(sq) && effect[them].count(sq) == 1)
+      info |= 1 << d;
+    // (2) 王が移動可能な升
+    if (!(pieces(them) & sq) && !effect[Us].count(sq))
+      info |= 1 << (d + 8);
+  }
 
   // 打つことで詰ませられる候補の駒(歩は打ち歩詰めになるので除外されている)
-  auto& mi = mate1ply_drop_tbl[info][Us];
+  const auto& mi = mate1ply_drop_tbl[info][Us];
 
   // 持っている手駒の種類
-  auto ourHand = toHandKind(hand[Us]);
+  const auto ourHand = toHandKind(hand[Us]);
 
   // 歩と桂はあとで移動の指し手のところでチェックするのでいまは問題としない。
-  auto hk = (HandKind)(ourHand & ~(HAND_KIND_PAWN | HAND_KIND_KNIGHT)) & mi.hand_kind;
-
-  // 駒打ちで詰む条件を満たしていない。
-  if (!hk) goto MOVE_MATE;
-
-  auto them = ~Us;
-  auto themKing = kingSquare[them];
+  const auto hk = (HandKind)(ourHand & ~(HAND_KIND_PAWN | HAND_KIND_KNIGHT) & mi.hand_kind);
 
   // 解説)
 
   // directions : PIECE 打ちで詰む可能性のある、玉から見た方角
   //  ※　大駒の利きを遮断していなければこれで詰む。
   // to         : PIECEを実際に打つ升
-  // cut_off    : toの升で大駒の利きを遮断しているとしたら、その方角
-  //  ※  それを補償する利きがあるかを調べる)
-  // to2        : 大駒の利きが遮断されたであろう、詰みに関係する升
-  //  ※　to2の升は、mate1ply_drop_tblがうまく作られていて、(2)の条件により盤外は除外されている。
-  // toにPIECEを打つことでto2の升の大駒の利きが1つ減るが、いまのto2の地点の利きが1より大きければ、
-  // 他の駒が利いているということでto2の升に関しては問題ない。
-
-#define CHECK_PIECE(DROP_PIECE) \
-  if (hk & HAND_KIND_ ## DROP_PIECE) {                                                              \
-    uint32_t directions = mi.directions[DROP_PIECE];                                                \
-    Piece pc = make_piece(DROP_PIECE, Us);                                                          \
-    while (directions) {                                                                            \
-      Direct to_direct = pop_directions(directions);                                                \
-      to = themKing + DirectToDelta(to_direct);                                                     \
-      uint32_t cut_off = cutoff_directions[pc][to_direct] & long_effect[Us].directions(to);         \
-      while (cut_off) {                                                                             \
-        Direct cut_direction = pop_directions(cut_off);                                             \
-        Square to2 = to + DirectToDelta(cut_direction);                                             \
-          if (effect[Us].count(to2) <= 1)                                                           \
-          goto Next ## DROP_PIECE;                                                                  \
-      }                                                                                             \
-      return make_move_drop(GOLD, to);                                                              \
-    Next ## DROP_PIECE:;                                                                            \
-    }                                                                                               \
-  }
-
-  // 一番詰みそうな金から調べていく
-  CHECK_PIECE(GOLD);
-  CHECK_PIECE(SILVER);
-  CHECK_PIECE(ROOK) else CHECK_PIECE(LANCE); // 飛車打ちで詰まないときに香打ちで詰むことはないのでチェックを除外
-  CHECK_PIECE(BISHOP);
-
-#undef CHECK_PIECE
+  // drop_cuts_off() : toの升で攻め方の長い利きを遮断して、玉の逃げ道ができないか
 
-MOVE_MATE:
+  if (hk)
+  {
+    for (Piece pt : { GOLD, SILVER, ROOK, LANCE, BISHOP }) // 一番詰みそうな金から調べていく
+    {
+      if (!hand_exists(hk, pt))
+        continue;
+      // 飛車打ちで詰まないときに香打ちで詰むことはないのでチェックを除外
+      if (pt == LANCE && hand_exists(hk, ROOK))
+        continue;
+
+      uint32_t directions = mi.directions[pt];
+      while (directions)
+      {
+        const Square to = SquareDirect[themKing][pop_directions(directions)];
+        if (!drop_cuts_off(*this, to, make_piece(pt, Us)))
+          return make_move_drop(pt, to);
+      }
+    }
+  }
 
   // --- 移動による詰み
 
-  auto& pinned = state()->checkInfo.pinned;
+  const Bitboard& pinned = st->checkInfo.pinned;
 
   // 玉の逃げ道がないことはわかっているのであとは桂が打ててかつ、その場所に敵の利きがなければ詰む。
-  // あるいは、桂馬を持っていないとして、その地点に桂馬を跳ねれば詰む。
+  // あるいは、その地点に桂馬を跳ねれば詰む。
   if (mi.hand_kind & HAND_KIND_KNIGHT)
   {
-    auto drop_target = knightEffect(them, themKing) & ~pieces();
-    while (drop_target) {
-      to = drop_target.pop();
-      if (!effect[them].count(to))
+    auto target = knightEffect(them, themKing) & ~pieces(Us);
+    while (target)
+    {
+      const Square to = target.pop();
+      if (effect[them].count(to))
+        continue;
+
+      // 桂馬を持っているならここに打って詰み
+      if (board[to] == NO_PIECE && hand_exists(ourHand, KNIGHT) && !drop_cuts_off(*this, to, make_piece(KNIGHT, Us)))
+        return make_move_drop(KNIGHT, to);
+
+      // toに利く桂があるならそれを跳ねて詰み。ただしpinされていると駄目
+      auto froms = knightEffect(them, to) & pieces(Us, KNIGHT);
+      while (froms)
       {
-        // 桂馬を持っているならここに打って詰み
-        if (ourHand & HAND_KIND_KNIGHT) return make_move_drop(KNIGHT, to);
-
-        // toに利く桂があるならそれを跳ねて詰み。ただしpinされていると駄目
-        auto froms = knightEffect(them, to);
-        while (froms) {
-          from = froms.pop();
-          if (!(pinned & from))
-            return make_move(from, to);
-        }
+        const Square from = froms.pop();
+        if (mate_by_move(*this, from, to, make_piece(KNIGHT, Us), pinned))
+          return make_move(from, to);
       }
     }
   }
 
-  // ここで判定するのは近接王手におる詰みのみ。両王手による詰みは稀なので除外。
-  // 対象 a) 敵玉の8近傍で、味方の利きが２つ以上ある升
-  //   a)に駒を移動させることによる詰みを調べる。
-  // 移動させた升において遠方駒の利きを遮断するかどうかのチェックが必要
-  //   a)があること自体が稀なのでこのチェックを高速化しして、a)があったときの処理はそれほど高速化に力を入れない。
-  // (レアケースでしか起きないことのために大きなテーブルを使うわけにはいかない)
-  // 影の利きがあって詰むパターンは対象外。
-
-
+  // ここで判定するのは近接王手による詰み。
+  // 対象 : 敵玉の8近傍で、味方の利きが2つ以上あり(動かす駒と、玉で取られないように支える駒)、
+  //        受け方の利きが玉だけの升。そこに駒を移動させて王手になるなら、mate_by_move()で詰みを調べる。
+  // fromを空けることで味方の長い利きが延びて支えになるパターンは対象外。
+  Bitboard target = kingEffect(themKing) & ~pieces(Us);
+  while (target)
+  {
+    const Square to = target.pop();
+    if (effect[Us].count(to) < 2 || effect[them].count(to) > 1)
+      continue;
+
+    // 攻め方の玉は敵玉に近づけない。
+    Bitboard froms = attackers_to(Us, to) & ~pieces(Us, KING);
+    while (froms)
+    {
+      const Square from = froms.pop();
+      const Piece pc = piece_on(from);
+      const Piece pt = type_of(pc);
+
+      // 成る指し手
+      if (pt < GOLD && (canPromote(Us, from) || canPromote(Us, to))
+        && (effects_from(pc + PIECE_PROMOTE, to, pieces()) & themKing)
+        && mate_by_move(*this, from, to, pc + PIECE_PROMOTE, pinned))
+        return make_move_promote(from, to);
+
+      // 成らない指し手。行き所のない駒になる指し手は除く。
+      if (((pt == PAWN || pt == LANCE) && (rank1_n_bb(Us, RANK_1) & to))
+        || (pt == KNIGHT && (rank1_n_bb(Us, RANK_2) & to)))
+        continue;
+      if ((effects_from(pc, to, pieces()) & themKing) && mate_by_move(*this, from, to, pc, pinned))
+        return make_move(from, to);
+    }
+  }
 
   return MOVE_NONE;
 }
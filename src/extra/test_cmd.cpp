@@ -1,3 +1,6 @@
+// shogi.hでFILEがdefineされるので、<fstream>はそれより先にincludeしておく。
+#include <algorithm>
+#include <fstream>
 #include "../shogi.h"
 
 // USI拡張コマンドのうち、開発上のテスト関係のコマンド。
@@ -6,6 +9,10 @@
 #ifdef ENABLE_TEST_CMD
 
 #include "all.h"
+#ifdef COOPERATIVE_MATE_SOLVER
+#include <cmath>
+#include "cooperative_mate_solver.h"
+#endif
 
 // ----------------------------------
 //      USI拡張コマンド "perft"
@@ -301,35 +308,279 @@ void test_genchecks(Position& pos, istringstream& is)
 }
 
 
+// --- "test countmoves"コマンド
+
+// ランダムプレイヤーで局面を進めながら、countMoves<GenType>()がMoveList<GenType>::size()と一致するかを調べる。
+// そのあと、集めた局面に対して両者の速度を比較する。
+template <MOVE_GEN_TYPE GenType>
+bool test_countmoves_check(const Position& pos, const char* name)
+{
+  const int n1 = countMoves<GenType>(pos);
+  const size_t n2 = MoveList<GenType>(pos).size();
+  if (n1 == (int)n2)
+    return true;
+  cout << endl << pos << name << " : countMoves = " << n1 << " , MoveList::size() = " << n2 << endl;
+  return false;
+}
+
+// sfensの各局面についてloop回ずつ数える。返し値は[ms]。
+template <MOVE_GEN_TYPE GenType, bool Count>
+int64_t bench_countmoves(Position& pos, const std::vector<std::string>& sfens, int loop, uint64_t& sum)
+{
+  int64_t time = 0;
+  for (auto& sfen : sfens)
+  {
+    pos.set(sfen);
+    pos.check_info_update();
+    auto start = now();
+    for (int i = 0; i < loop; ++i)
+      sum += Count ? countMoves<GenType>(pos) : MoveList<GenType>(pos).size();
+    time += now() - start;
+  }
+  return time;
+}
+
+void test_countmoves(Position& pos, istringstream& is)
+{
+  uint64_t loop_max = 10000; // 1万回
+  is >> loop_max;
+  cout << "countMoves test , loop_max = " << loop_max << endl;
+
+  const char* start_sfens[] = {
+    "lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1",
+    "ln1g1g1nl/1r1s1k1b1/p1pp1pp1p/4p4/1p5p1/9/PPPPPPPPP/1B2K2R1/LNSG1GSNL b GSNLPgsnlp 1",
+    "4k4/9/4P4/9/9/9/9/9/4K4 b 2G2S2N2L2R2Bgsnlp 1",
+  };
+
+  const int MAX_PLY = 256;
+  StateInfo state[MAX_PLY];
+  Move moves[MAX_PLY];
+  PRNG prng(20161016);
+  uint64_t nodes = 0, error_count = 0;
+
+  // 速度比較用に集める局面(王手されていない局面と王手されている局面)
+  std::vector<std::string> non_evasions, evasions;
+
+  for (uint64_t i = 0; i < loop_max; ++i)
+  {
+    pos.set(start_sfens[i % (sizeof(start_sfens) / sizeof(start_sfens[0]))]);
+
+    int ply;
+    for (ply = 0; ply < MAX_PLY; ++ply)
+    {
+      MoveList<LEGAL_ALL> mg(pos);
+      if (mg.size() == 0)
+        break;
+
+      ++nodes;
+      pos.check_info_update();
+      bool ok = true;
+      if (pos.in_check())
+      {
+        ok &= test_countmoves_check<EVASIONS>(pos, "EVASIONS");
+        ok &= test_countmoves_check<LEGAL_EVASIONS>(pos, "LEGAL_EVASIONS");
+#ifdef COOPERATIVE_MATE_SOLVER
+        ok &= test_countmoves_check<EVASIONS_ALL>(pos, "EVASIONS_ALL");
+        ok &= test_countmoves_check<LEGAL_EVASIONS_ALL>(pos, "LEGAL_EVASIONS_ALL");
+#endif
+        if (evasions.size() < 10000 && (nodes % 7) == 0)
+          evasions.push_back(pos.sfen());
+      } else {
+        ok &= test_countmoves_check<NON_EVASIONS>(pos, "NON_EVASIONS");
+        ok &= test_countmoves_check<NON_CAPTURES_PRO_MINUS>(pos, "NON_CAPTURES_PRO_MINUS");
+        ok &= test_countmoves_check<CAPTURES_PRO_PLUS>(pos, "CAPTURES_PRO_PLUS");
+        if (non_evasions.size() < 10000 && (nodes % 7) == 0)
+          non_evasions.push_back(pos.sfen());
+      }
+      error_count += !ok;
+
+      // 王手があれば2回に1回は王手を選ぶ。(王手されている局面を増やすため)
+      std::vector<Move> checks;
+      for (auto m : mg)
+        if (pos.gives_check(m))
+          checks.push_back(m);
+      Move m = (!checks.empty() && prng.rand<uint32_t>() % 2)
+        ? checks[prng.rand<uint32_t>() % checks.size()]
+        : mg.begin()[prng.rand<uint32_t>() % mg.size()].move;
+
+      pos.do_move(m, state[ply]);
+      moves[ply] = m;
+    }
+    while (ply > 0)
+      pos.undo_move(moves[--ply]);
+
+    if ((i % 1000) == 0)
+      cout << ".";
+  }
+  cout << endl << "nodes = " << nodes << " , error = " << error_count << endl;
+
+  // 速度比較。sumは最適化で消されないようにするためと、両者の一致の確認用。
+  const int loop = 1000;
+  uint64_t sum1 = 0, sum2 = 0;
+  auto report = [&](const char* name, size_t positions, int64_t t1, int64_t t2) {
+    cout << name << " : positions = " << positions << " , MoveList::size() = " << t1 << "[ms] , countMoves = " << t2 << "[ms]"
+      << " , speedup = " << (t2 ? (double)t1 / t2 : 0.0) << endl;
+  };
+
+  report("NON_EVASIONS", non_evasions.size(),
+    bench_countmoves<NON_EVASIONS, false>(pos, non_evasions, loop, sum1),
+    bench_countmoves<NON_EVASIONS, true >(pos, non_evasions, loop, sum2));
+  report("LEGAL_EVASIONS", evasions.size(),
+    bench_countmoves<LEGAL_EVASIONS, false>(pos, evasions, loop, sum1),
+    bench_countmoves<LEGAL_EVASIONS, true >(pos, evasions, loop, sum2));
+#ifdef COOPERATIVE_MATE_SOLVER
+  report("LEGAL_EVASIONS_ALL", evasions.size(),
+    bench_countmoves<LEGAL_EVASIONS_ALL, false>(pos, evasions, loop, sum1),
+    bench_countmoves<LEGAL_EVASIONS_ALL, true >(pos, evasions, loop, sum2));
+#endif
+  if (sum1 != sum2)
+    ++error_count;
+
+  cout << (error_count ? "failed." : "finished.") << endl;
+}
+
+
+#ifdef MATE_1PLY
+// --- "test mate1ply"コマンド
+
+// ランダムプレイヤーに王手を多めに指させて、
+//  1) 差分更新している利き(Position::effect , long_effect)が、初めから計算したものと一致するか
+//  2) mate1ply()が返した指し手が、合法手で、かつ本当に1手詰めになっているか
+// を判定する。あわせて、全合法手を調べた1手詰めのうちmate1ply()で見つけられた割合を表示する。
+void test_mate1ply(Position& pos, istringstream& is)
+{
+  uint64_t loop_max = 100000; // 10万回
+  is >> loop_max;
+  cout << "mate1ply test , loop_max = " << loop_max << endl;
+
+  // 平手と、玉の近くに駒がある局面
+  const char* sfens[] = {
+    "lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1",
+    "9/9/9/3bkb3/9/3+R1+R3/9/9/9 b - 1",
+    "7nk/9/9/9/9/9/9/9/9 b S - 1",
+    "9/9/9/9/4k4/9/9/9/9 b RB - 1",
+    "ln1g1g1nl/1r1s1k1b1/p1pp1pp1p/4p4/1p5p1/9/PPPPPPPPP/1B2K2R1/LNSG1GSNL b GSNLPgsnlp 1",
+    "4k4/9/4P4/9/9/9/9/9/4K4 b 2G2S2N2L2R2Bgsnlp 1",
+  };
+
+  const int MAX_PLY = 256;
+  StateInfo state[MAX_PLY];
+  Move moves[MAX_PLY];
+  PRNG prng(20161016);
+  uint64_t mate_count = 0, found_count = 0, error_count = 0, nodes = 0;
+
+  for (uint64_t i = 0; i < loop_max; ++i)
+  {
+    pos.set(sfens[i % (sizeof(sfens) / sizeof(sfens[0]))]);
+
+    int ply;
+    for (ply = 0; ply < MAX_PLY; ++ply)
+    {
+      ++nodes;
+      if (!pos.effect_is_ok())
+      {
+        cout << endl << pos << "effect mismatch" << endl;
+        ++error_count;
+      }
+
+      MoveList<LEGAL_ALL> mg(pos);
+      if (mg.size() == 0)
+        break;
+
+      pos.check_info_update();
+      std::vector<Move> checks;
+      bool mate = false;
+      for (auto m : mg)
+        if (pos.gives_check(m))
+        {
+          checks.push_back(m);
+          StateInfo si;
+          pos.do_move(m, si, true);
+          mate |= pos.is_mated();
+          pos.undo_move(m);
+        }
+
+      if (!pos.in_check())
+      {
+        mate_count += mate;
+        Move m = pos.mate1ply();
+        if (m != MOVE_NONE)
+        {
+          // 合法手であり、1手詰めでなければならない。
+          bool ok = false;
+          for (auto m2 : mg)
+            if (m2.move == m)
+            {
+              StateInfo si;
+              pos.do_move(m, si);
+              ok = pos.is_mated();
+              pos.undo_move(m);
+            }
+          if (ok)
+            ++found_count;
+          else
+          {
+            cout << endl << pos << "mate1ply error : move = " << m << endl;
+            ++error_count;
+          }
+        }
+      }
+
+      // 王手があれば3回に2回は王手を選ぶ。
+      Move m = (!checks.empty() && prng.rand<uint32_t>() % 3)
+        ? checks[prng.rand<uint32_t>() % checks.size()]
+        : mg.begin()[prng.rand<uint32_t>() % mg.size()].move;
+
+      pos.do_move(m, state[ply]);
+      moves[ply] = m;
+    }
+    while (ply > 0)
+      pos.undo_move(moves[--ply]);
+
+    if ((i % 1000) == 0)
+      cout << ".";
+  }
+  cout << endl << "nodes = " << nodes << " , mate in 1 = " << mate_count << " , found by mate1ply = " << found_count
+    << " , error = " << error_count << endl;
+  cout << (error_count ? "failed." : "finished.") << endl;
+}
+#endif
+
+
 // --- "test cm"コマンド
 
 // 協力詰め。n手で協力詰めで詰むかを調べる。
 
 // 再帰的に呼び出される
 // depth = 残り探索深さ
-void cooperation_mate(Position& pos, int depth)
+// moves = 開始局面からこの局面までの指し手
+// (KEEP_LAST_MOVEがundefされていてもmoves_from_start()に頼らずに手順を表示できるように自前で積む)
+void cooperation_mate(Position& pos, int depth, std::vector<Move>& moves)
 {
-  // moves_from_start_pretty()がKEEP_LAST_MOVEを要求する。
-#ifdef  KEEP_LAST_MOVE
-
   StateInfo st;
   for (auto m : MoveList<LEGAL_ALL>(pos))
   {
     pos.do_move(m.move, st);
+    moves.push_back(m.move);
 
     if (pos.is_mated())
     {
       // 後手の詰みなら手順を表示する。先手の詰みは必要ない。
       if (pos.side_to_move() == WHITE)
-        cout << pos << pos.moves_from_start_pretty() << endl; // 開始局面からそこまでの手順
+      {
+        cout << pos;
+        for (auto m2 : moves) // 開始局面からそこまでの手順
+          cout << m2 << ' ';
+        cout << endl;
+      }
     } else {
       // 残り探索深さがあるなら再帰的に探索する。
       if (depth > 1)
-        cooperation_mate(pos, depth - 1);
+        cooperation_mate(pos, depth - 1, moves);
     }
+    moves.pop_back();
     pos.undo_move(m.move);
   }
-#endif
 }
 
 // 協力詰めコマンド
@@ -343,10 +594,561 @@ void cooperation_mate_cmd(Position& pos, istringstream& is)
   int depth = 5;
   is >> depth;
   cout << "Cooperation Mate test , depth = " << depth << endl;
-  cooperation_mate(pos, depth); // 与えられた局面からdepth深さの協力詰みを探す
+  std::vector<Move> moves;
+  cooperation_mate(pos, depth, moves); // 与えられた局面からdepth深さの協力詰みを探す
   cout << "finished." << endl;
 }
 
+#ifdef COOPERATIVE_MATE_SOLVER
+
+// --- "test cmtt"コマンド
+
+// 協力詰め用の置換表のprobe()/save()のスループットを計測する。
+// 探索と同じく、全スレッドが同じ局面集合に対してprobe()して、hitしなければsave()する。
+// 戻り値は全スレッド合計の1秒あたりの処理数(M回)
+template <typename Cluster>
+double bench_cm_tt(int thread_num, size_t hash_mb, int time_ms)
+{
+  std::unique_ptr<CooperativeMate::TranspositionTable<Cluster>> tt(new CooperativeMate::TranspositionTable<Cluster>);
+  tt->resize(hash_mb);
+  tt->new_search();
+
+  // 局面の数は置換表のentry数の2倍にしておく。
+  const uint64_t key_space = (uint64_t)hash_mb * 1024 * 1024 / sizeof(Cluster) * Cluster::ClusterSize * 2;
+
+  std::atomic<bool> stop(false);
+  std::vector<uint64_t> ops(thread_num);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_num; ++t)
+    threads.push_back(std::thread([&, t] {
+      PRNG prng(t + 1);
+      uint64_t n = 0;
+      while (!stop)
+      {
+        for (int i = 0; i < 1024; ++i)
+        {
+          const uint64_t k = prng.rand<uint64_t>() % key_space;
+          Key128 key;
+          key.set(k * UINT64_C(0x9E3779B97F4A7C15), (k + 1) * UINT64_C(0xC2B2AE3D27D4EB4F));
+          uint32_t depth = (uint32_t)(k & 15) + 1;
+          Move tt_move;
+          if (!tt->probe(key, depth, tt_move))
+            tt->save(key, depth, MOVE_NONE);
+        }
+        n += 1024;
+      }
+      ops[t] = n;
+    }));
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(time_ms));
+  stop = true;
+  for (auto& th : threads)
+    th.join();
+
+  uint64_t total = 0;
+  for (auto n : ops)
+    total += n;
+  return (double)total / time_ms / 1000;
+}
+
+// 置換表のClusterの種類ごとに、スレッド数を増やしていったときの置換表のスループットを比較する。
+// 例)
+//  test cmtt 32 1024 3000
+//  (最大32スレッド、置換表1024MB、1回の計測3000ms)
+// 置換表のサイズを小さくするとClusterの競合が増えるので、lockの影響がわかりやすくなる。
+void bench_cm_tt_cmd(istringstream& is)
+{
+  int max_threads = 8;
+  size_t hash_mb = 16;
+  int time_ms = 1000;
+  is >> max_threads >> hash_mb >> time_ms;
+
+  cout << "CM TT bench , max_threads = " << max_threads << " , hash = " << hash_mb << "MB , time = " << time_ms << "ms" << endl;
+  cout << "threads\tlocked[Mops]\tlockless[Mops]\tbucket[Mops]\tcompact<28>[Mops]\thand[Mops]" << endl;
+  for (int t = 1; ; t = std::min(t * 2, max_threads))
+  {
+    cout << t
+      << "\t" << bench_cm_tt<CooperativeMate::LockedCluster>(t, hash_mb, time_ms)
+      << "\t" << bench_cm_tt<CooperativeMate::LocklessCluster>(t, hash_mb, time_ms)
+      << "\t" << bench_cm_tt<CooperativeMate::BucketCluster>(t, hash_mb, time_ms)
+      << "\t" << bench_cm_tt<CooperativeMate::CompactCluster<28>>(t, hash_mb, time_ms)
+      << "\t" << bench_cm_tt<CooperativeMate::HandCluster>(t, hash_mb, time_ms) << endl;
+    if (t == max_threads)
+      break;
+  }
+  cout << "finished." << endl;
+}
+
+// --- "test cmtag"コマンド
+
+// 置換表を局面で埋めたあと、保存していない局面でprobe()して、誤ってhitした割合を調べる。
+// tag_bits = entryの照合に用いているkeyのbit数(indexに用いるbitは含まない)
+template <typename Cluster>
+void report_cm_tt_collision(const char* name, int tag_bits, size_t hash_mb, uint64_t probes)
+{
+  std::unique_ptr<CooperativeMate::TranspositionTable<Cluster>> tt(new CooperativeMate::TranspositionTable<Cluster>);
+  tt->resize(hash_mb);
+  tt->new_search();
+
+  auto make_key = [](PRNG& prng) {
+    Key128 key;
+    key.set(prng.rand<uint64_t>(), prng.rand<uint64_t>());
+    return key;
+  };
+
+  // entry数だけ局面を保存する。
+  const uint64_t entries = (uint64_t)hash_mb * 1024 * 1024 / sizeof(Cluster) * Cluster::ClusterSize;
+  PRNG prng_save(1);
+  for (uint64_t i = 0; i < entries; ++i)
+    tt->save(make_key(prng_save), 1, MOVE_NONE);
+
+  // 保存していない局面でprobe()する。depth 1ならどのentryにhitしてもtrueが返る。
+  PRNG prng_probe(2);
+  uint64_t hit = 0;
+  for (uint64_t i = 0; i < probes; ++i)
+  {
+    uint32_t depth = 1;
+    Move tt_move;
+    if (tt->probe(make_key(prng_probe), depth, tt_move))
+      ++hit;
+  }
+
+  // 期待値 : Cluster内の使用中のentryの数 / 2^tag_bits
+  const double fill = tt->hashfull() / 1000.0;
+  const double expected = fill * Cluster::ClusterSize / std::pow(2.0, tag_bits);
+  cout << name
+    << "\t" << tag_bits
+    << "\t" << (entries / hash_mb)
+    << "\t" << fill
+    << "\t" << ((double)hit / probes)
+    << "\t" << expected
+    << "\t" << (expected * 1e9) << endl;
+}
+
+// 同じdepthのentryで埋まったClusterに新しい局面を保存したときに、古い世代のentryが置き換えられるかを調べる。
+template <typename Cluster>
+bool check_cm_tt_replace(const char* name)
+{
+  std::unique_ptr<Cluster> cluster(new Cluster);
+  memset(cluster.get(), 0, sizeof(Cluster));
+
+  // tagはどのClusterでもp(1)の上位bitから取るので、上位bitが異なるkeyにしておく。
+  auto make_key = [](int i) {
+    Key128 key;
+    key.set(UINT64_C(0x0123456789abcdef) * (i + 1), UINT64_C(0x1111111111111111) * (i + 1));
+    return key;
+  };
+
+  // 1つだけ1世代前のentryにしておく。
+  const uint16_t generation = 2;
+  const int old = Cluster::ClusterSize / 2;
+  for (int i = 0; i < Cluster::ClusterSize; ++i)
+    cluster->save(make_key(i), 5, MOVE_NONE, i == old ? generation - 1 : generation);
+  cluster->save(make_key(Cluster::ClusterSize), 5, MOVE_NONE, generation);
+
+  // 古い世代のentryだけが消えていなければならない。
+  bool ok = true;
+  for (int i = 0; i <= Cluster::ClusterSize; ++i)
+  {
+    uint32_t depth = 5;
+    Move tt_move;
+    ok &= cluster->probe(make_key(i), depth, tt_move, generation) == (i != old);
+  }
+  cout << name << "\treplace older generation\t" << (ok ? "ok" : "failed") << endl;
+  return ok;
+}
+
+// Clusterの種類ごとに、1MBあたりのentry数とhash衝突の割合を表示する。
+// 例)
+//  test cmtag 64 100000000
+//  (置換表64MB、1億回probe)
+// 置換表に保存されていない局面が置換表にhitすると、詰む局面を詰まないと誤判定する可能性がある。
+// 解く問題の局面数とprobe回数から、どのClusterを使うかを決めるときの参考にする。
+void report_cm_tt_collision_cmd(istringstream& is)
+{
+  size_t hash_mb = 16;
+  uint64_t probes = 10000000;
+  is >> hash_mb >> probes;
+
+  cout << "CM TT collision , hash = " << hash_mb << "MB , probes = " << probes << endl;
+  cout << "cluster\ttag_bits\tentries/MB\tfill\tcollision rate\texpected\tper 1e9 probes" << endl;
+  report_cm_tt_collision<CooperativeMate::LocklessCluster>("lockless", 64, hash_mb, probes);
+  report_cm_tt_collision<CooperativeMate::BucketCluster>("bucket", 32, hash_mb, probes);
+  report_cm_tt_collision<CooperativeMate::CompactCluster<30>>("compact<30>", 30, hash_mb, probes);
+  report_cm_tt_collision<CooperativeMate::CompactCluster<28>>("compact<28>", 28, hash_mb, probes);
+  report_cm_tt_collision<CooperativeMate::CompactCluster<24>>("compact<24>", 24, hash_mb, probes);
+  report_cm_tt_collision<CooperativeMate::CompactCluster<20>>("compact<20>", 20, hash_mb, probes);
+  report_cm_tt_collision<CooperativeMate::CompactCluster<16>>("compact<16>", 16, hash_mb, probes);
+
+  bool ok = true;
+  ok &= check_cm_tt_replace<CooperativeMate::LockedCluster>("locked");
+  ok &= check_cm_tt_replace<CooperativeMate::LocklessCluster>("lockless");
+  ok &= check_cm_tt_replace<CooperativeMate::BucketCluster>("bucket");
+  ok &= check_cm_tt_replace<CooperativeMate::CompactCluster<28>>("compact<28>");
+  ok &= check_cm_tt_replace<CooperativeMate::CompactCluster<16>>("compact<16>");
+  cout << (ok ? "finished." : "failed.") << endl;
+}
+
+// 協力詰めの探索の再帰版と非再帰版とで、同じ問題を1スレッドで解いて速度を比較する。
+// 置換表は問題ごと、版ごとにクリアする。両者は同じ局面を同じ順番で探索するので、探索ノード数と詰み手数は一致しなければならない。
+// 例)
+//  test cmsearch 1001
+//  (詰まない問題は残り探索深さ1001まで)
+// 再帰版はmax_depthを大きくするとstackが足りなくなってcrashすることがあるので注意。
+void bench_cm_search_cmd(istringstream& is)
+{
+  uint32_t max_depth = 301;
+  is >> max_depth;
+
+  const char* sfens[] = {
+    "9/6b2/7k1/5b3/7sL/9/9/9/9 b R - 1",
+    "9/9/9/3bkb3/9/3+R1+R3/9/9/9 b - 1",
+    "7nk/9/9/9/9/9/9/9/9 b S - 1",
+    "9/9/9/9/4k4/9/9/9/9 b RB - 1",
+    "8k/9/9/9/9/9/9/9/9 b G - 1", // 詰まない
+  };
+
+  cout << "CM search bench , max_depth = " << max_depth << endl;
+  cout << "sfen\tmate\trecursive[nodes]\t[ms]\tnonrecursive[nodes]\t[ms]\tresult" << endl;
+
+  int64_t total[2] = {};
+  bool ok = true;
+  for (auto sfen : sfens)
+  {
+    Position pos;
+    pos.set(sfen);
+
+    uint64_t nodes[2];
+    uint32_t mate[2];
+    int64_t time[2];
+    for (int i = 0; i < 2; ++i)
+    {
+      CooperativeMate::TT.clear();
+      auto start = now();
+      nodes[i] = CooperativeMate::id_search(pos, max_depth, i == 0, mate[i]);
+      time[i] = now() - start;
+      total[i] += time[i];
+    }
+
+    bool same = nodes[0] == nodes[1] && mate[0] == mate[1];
+    ok &= same;
+    cout << sfen << "\t" << mate[1]
+      << "\t" << nodes[0] << "\t" << time[0]
+      << "\t" << nodes[1] << "\t" << time[1]
+      << "\t" << (same ? "ok" : "MISMATCH") << endl;
+  }
+  cout << "total[ms] recursive = " << total[0] << " , nonrecursive = " << total[1] << endl;
+
+  // 循環で枝刈りした結果が置換表に残っていても、別の手順から到達した局面で詰みを見落とさないか。
+  // 2問目の局面は1問目の探索中に1問目の開始局面からの手順上に現れて、唯一の詰みに至る指し手が循環として枝刈りされる。
+  // 1問目を解いたあとの置換表のまま2問目を解いて、置換表をクリアして解いたときと詰み手数が一致しなければならない。
+  const char* cycle_sfens[][2] = {
+    { "9/9/9/9/9/9/9/6B2/6k2 b R 1", "9/9/9/9/9/9/9/1R4B2/6k2 b - 1" },
+    { "1G7/9/9/+P1B6/6k2/9/9/9/9 b S 1", "1G7/9/9/+P1B6/5Sk2/9/9/9/9 b - 1" },
+  };
+  const uint32_t cycle_depth = 9;
+  cout << "sfen\tafter\tmate\tmate(shared TT)[recursive]\t[nonrecursive]\tresult" << endl;
+  for (auto sfens2 : cycle_sfens)
+  {
+    Position first, pos;
+    first.set(sfens2[0]);
+    pos.set(sfens2[1]);
+
+    uint32_t mate, shared[2];
+    CooperativeMate::TT.clear();
+    CooperativeMate::id_search(pos, cycle_depth, false, mate);
+    for (int i = 0; i < 2; ++i)
+    {
+      uint32_t first_mate;
+      CooperativeMate::TT.clear();
+      CooperativeMate::id_search(first, cycle_depth, i == 0, first_mate);
+      CooperativeMate::id_search(pos, cycle_depth, i == 0, shared[i]);
+    }
+
+    bool same = mate != 0 && shared[0] == mate && shared[1] == mate;
+    ok &= same;
+    cout << sfens2[1] << "\t" << sfens2[0] << "\t" << mate << "\t" << shared[0] << "\t" << shared[1]
+      << "\t" << (same ? "ok" : "MISMATCH") << endl;
+  }
+
+  cout << (ok ? "finished." : "failed.") << endl;
+}
+
+// 協力詰めの末端の詰み判定(CM_LeafSolver)のテスト。
+// ・ランダムに局面を進めながら、王手をかけられている局面でhas_legal_evasion()とMoveList<LEGAL>の結果、
+//   MoveList<LEGAL_EVASIONS(_ALL)>とMoveList<LEGAL(_ALL)>の指し手の集合が、
+//   すべての局面でhas_legal_check()とMoveList<LEGAL_ALL>にgives_check()の指し手があるか、
+//   MoveList<LEGAL_CHECKS_ALL>とMoveList<LEGAL_ALL>のうち王手になる指し手の集合(と王手している駒)が、
+//   先手番の局面でleaf_mate1()と王手を1手ずつdo_move()して調べた結果が一致するかを調べる。
+//   王手になる指し手を優先して選ぶので、合駒やpinされた駒の絡む局面も出てくる。
+// ・問題集をCM_LeafSolverのon/offで解いて、詰み手数が一致するかを調べ、探索ノード数と時間を比較する。
+// 例)
+//  test cmleaf 10000
+//  (ランダムに進める対局の数)
+void bench_cm_leaf_cmd(istringstream& is)
+{
+  uint64_t loop_max = 10000;
+  is >> loop_max;
+
+  const char* sfens[] = {
+    "9/6b2/7k1/5b3/7sL/9/9/9/9 b R - 1",
+    "9/9/9/3bkb3/9/3+R1+R3/9/9/9 b - 1",
+    "7nk/9/9/9/9/9/9/9/9 b S - 1",
+    "9/9/9/9/4k4/9/9/9/9 b RB - 1",
+    "9/9/9/9/4k4/9/9/9/9 b GS - 1",
+    "8k/9/9/9/9/9/9/9/9 b GS - 1",
+  };
+
+  cout << "CM leaf solver test , loop_max = " << loop_max << endl;
+
+  // 1) ランダムな局面での一致
+  const int MAX_PLY = 256;
+  StateInfo state[MAX_PLY];
+  Move moves[MAX_PLY];
+  PRNG prng(20161016);
+  uint64_t evasion_count = 0, check_count = 0, mate1_count = 0, mismatch = 0;
+
+  Position pos;
+  for (uint64_t i = 0; i < loop_max; ++i)
+  {
+    // 半分は平手の初期局面から、残りは問題集の局面から始める。
+    if (i % 2)
+      pos.set(sfens[(i / 2) % (sizeof(sfens) / sizeof(sfens[0]))]);
+    else
+      pos.set_hirate();
+
+    int ply;
+    for (ply = 0; ply < MAX_PLY; ++ply)
+    {
+      MoveList<LEGAL> mg(pos);
+
+      {
+        ++check_count;
+        int checks = 0;
+        MoveList<LEGAL_ALL> all(pos); // check_info_update()も呼び出される。
+        for (auto m : all)
+          checks += pos.gives_check(m);
+        if (pos.has_legal_check() != (checks != 0))
+        {
+          cout << endl << pos << "has_legal_check mismatch" << endl;
+          ++mismatch;
+        }
+
+        // LEGAL_CHECKS_ALLは、LEGAL_ALLのうち王手になる指し手と同じ集合であり、記録された王手している駒が正しいこと。
+        MoveList<LEGAL_CHECKS_ALL> lc(pos);
+        bool same = lc.size() == (size_t)checks;
+        for (auto e : lc)
+        {
+          if (std::find(all.begin(), all.end(), e.move) == all.end() || !pos.gives_check(e.move))
+            same = false;
+          else
+          {
+            StateInfo si;
+            pos.do_move(e.move, si, true);
+            same &= checkers_of(e) == pos.checkers();
+            pos.undo_move(e.move);
+          }
+        }
+        if (!same)
+        {
+          cout << endl << pos << "LEGAL_CHECKS mismatch" << endl;
+          ++mismatch;
+        }
+      }
+
+      if (pos.in_check())
+      {
+        ++evasion_count;
+        if (pos.has_legal_evasion() != (mg.size() != 0))
+        {
+          cout << endl << pos << "has_legal_evasion mismatch" << endl;
+          ++mismatch;
+        }
+
+        // LEGAL_EVASIONS(_ALL)は、LEGAL(_ALL)と同じ指し手の集合であること。
+        MoveList<LEGAL_EVASIONS> le(pos);
+        MoveList<LEGAL_EVASIONS_ALL> lea(pos);
+        MoveList<LEGAL_ALL> la(pos);
+        bool same = le.size() == mg.size() && lea.size() == la.size();
+        for (auto m : le)
+          same &= std::find(mg.begin(), mg.end(), m.move) != mg.end();
+        for (auto m : lea)
+          same &= std::find(la.begin(), la.end(), m.move) != la.end();
+        if (!same)
+        {
+          cout << endl << pos << "LEGAL_EVASIONS mismatch" << endl;
+          ++mismatch;
+        }
+      }
+      else if (pos.side_to_move() == BLACK)
+      {
+        ++mate1_count;
+
+        // 再帰版のsearch()でdepth == 1のときと同じ方法で調べる。
+        int replyCount = 0;
+        Move oneReply = MOVE_NONE, mate_move = MOVE_NONE;
+        pos.check_info_update();
+        for (auto m : MoveList<CHECKS_ALL>(pos))
+        {
+          if (!pos.legal(m))
+            continue;
+          StateInfo si;
+          pos.do_move(m, si, pos.gives_check(m));
+          bool mated = pos.is_mated();
+          pos.undo_move(m);
+          if (mated)
+          {
+            mate_move = m;
+            break;
+          }
+          replyCount++;
+          oneReply = m;
+        }
+
+        int leafReplyCount;
+        Move leafOneReply;
+        Move leaf_move = CooperativeMate::leaf_mate1(pos, MOVE_NONE, leafReplyCount, leafOneReply);
+        // 詰みがあるかと、詰みがないときの王手の数とone replyが一致すること。(複数の詰みがあればどれを返すかは問わない)
+        if ((leaf_move != MOVE_NONE) != (mate_move != MOVE_NONE)
+          || (mate_move == MOVE_NONE && (leafReplyCount != replyCount || leafOneReply != oneReply)))
+        {
+          cout << endl << pos << "leaf_mate1 mismatch : " << mate_move << " " << leaf_move << endl;
+          ++mismatch;
+        }
+      }
+
+      if (mg.size() == 0)
+        break;
+
+      // 王手があれば3回に2回は王手を選ぶ。
+      std::vector<Move> checks;
+      pos.check_info_update();
+      for (auto m : mg)
+        if (pos.gives_check(m))
+          checks.push_back(m);
+      Move m = (!checks.empty() && prng.rand<uint32_t>() % 3)
+        ? checks[prng.rand<uint32_t>() % checks.size()]
+        : mg.begin()[prng.rand<uint32_t>() % mg.size()].move;
+
+      pos.do_move(m, state[ply]);
+      moves[ply] = m;
+    }
+    while (ply > 0)
+      pos.undo_move(moves[--ply]);
+
+    if ((i % 1000) == 0)
+      cout << ".";
+  }
+  cout << endl << "evasion positions = " << evasion_count << " , check positions = " << check_count
+    << " , mate1 positions = " << mate1_count
+    << " , mismatch = " << mismatch << endl;
+
+  // 2) 問題集をCM_LeafSolverのon/offで解く。
+  const uint32_t max_depth = 31;
+  auto saved = CooperativeMate::leaf_solver;
+  bool ok = mismatch == 0;
+
+  cout << "sfen\tmate\tleaf off[nodes]\t[ms]\tleaf on[nodes]\t[ms]\tresult" << endl;
+  uint64_t total_nodes[2] = {};
+  int64_t total_time[2] = {};
+  for (auto sfen : sfens)
+  {
+    pos.set(sfen);
+    uint64_t nodes[2];
+    uint32_t mate[2];
+    int64_t time[2];
+    for (int i = 0; i < 2; ++i)
+    {
+      CooperativeMate::leaf_solver = i == 1;
+      CooperativeMate::TT.clear();
+      auto start = now();
+      nodes[i] = CooperativeMate::id_search(pos, max_depth, false, mate[i]);
+      time[i] = now() - start;
+      total_nodes[i] += nodes[i];
+      total_time[i] += time[i];
+    }
+    bool same = mate[0] == mate[1];
+    ok &= same;
+    cout << sfen << "\t" << mate[1]
+      << "\t" << nodes[0] << "\t" << time[0]
+      << "\t" << nodes[1] << "\t" << time[1]
+      << "\t" << (same ? "ok" : "MISMATCH") << endl;
+  }
+  CooperativeMate::leaf_solver = saved;
+
+  cout << "total\t\t" << total_nodes[0] << "\t" << total_time[0] << "\t" << total_nodes[1] << "\t" << total_time[1] << endl;
+  cout << (ok ? "finished." : "failed.") << endl;
+}
+
+// 協力詰めの探索のparamを変えて同じ問題集を非再帰版の探索で解き、探索ノード数と時間を比較する。
+// ファイルを指定したら、そのsfenを問題集として用いる。("test cmorder"と"test cmhistory"用)
+void bench_cm_param(istringstream& is, const char* name, uint32_t& param)
+{
+  std::string path;
+  is >> path;
+
+  std::vector<std::string> sfens;
+  if (path.empty())
+    sfens = {
+      "9/6b2/7k1/5b3/7sL/9/9/9/9 b R - 1",
+      "9/9/9/3bkb3/9/3+R1+R3/9/9/9 b - 1",
+      "7nk/9/9/9/9/9/9/9/9 b S - 1",
+      "9/9/9/9/4k4/9/9/9/9 b RB - 1",
+      "9/9/9/9/4k4/9/9/9/9 b GS - 1",
+      "8k/9/9/9/9/9/9/9/9 b GS - 1",
+    };
+  else
+  {
+    std::ifstream fs(path);
+    std::string line;
+    while (getline(fs, line))
+      if (!line.empty() && line[0] != '#')
+        sfens.push_back(line);
+  }
+
+  const uint32_t values[] = { 0, 1, 3, 5, 7 };
+  const int N = sizeof(values) / sizeof(values[0]);
+  const uint32_t max_depth = 31;
+  auto saved = param;
+
+  cout << "CM " << name << " bench" << endl;
+  cout << "sfen\tmate";
+  for (auto v : values)
+    cout << "\t" << name << " " << v << "[nodes]\t[ms]";
+  cout << endl;
+
+  uint64_t total_nodes[N] = {};
+  int64_t total_time[N] = {};
+  for (auto& sfen : sfens)
+  {
+    Position pos;
+    pos.set(sfen);
+    cout << sfen;
+    uint32_t mate = 0;
+    std::stringstream ss;
+    for (int i = 0; i < N; ++i)
+    {
+      param = values[i];
+      CooperativeMate::TT.clear();
+      auto start = now();
+      auto nodes = CooperativeMate::id_search(pos, max_depth, false, mate);
+      auto time = now() - start;
+      total_nodes[i] += nodes;
+      total_time[i] += time;
+      ss << "\t" << nodes << "\t" << time;
+    }
+    cout << "\t" << mate << ss.str() << endl;
+  }
+
+  cout << "total";
+  for (int i = 0; i < N; ++i)
+    cout << "\t" << total_nodes[i] << "\t" << total_time[i];
+  cout << endl;
+  param = saved;
+}
+
+#endif // COOPERATIVE_MATE_SOLVER
+
 // --- "s" 指し手生成テストコマンド
 void generate_moves_cmd(Position& pos)
 {
@@ -478,12 +1280,36 @@ void test_cmd(Position& pos, istringstream& is)
   else if (param == "rp") random_player_cmd(pos,is); // ランダムプレイヤー
   else if (param == "cm") cooperation_mate_cmd(pos, is); // 協力詰めルーチン
   else if (param == "checks") test_genchecks(pos, is); // 王手生成ルーチンのテスト
+  else if (param == "countmoves") test_countmoves(pos, is); // 指し手の数だけを数えるルーチンのテストとベンチマーク
+#ifdef MATE_1PLY
+  else if (param == "mate1ply") test_mate1ply(pos, is); // 1手詰め判定ルーチンと利きの差分更新のテスト
+#endif
   else if (param == "hand") test_hand(); // 手駒の優劣関係などのテスト
+#ifdef COOPERATIVE_MATE_SOLVER
+  else if (param == "cmtt") bench_cm_tt_cmd(is); // 協力詰め用の置換表のベンチマーク
+  else if (param == "cmtag") report_cm_tt_collision_cmd(is); // 協力詰め用の置換表のhash衝突率
+  else if (param == "cmsearch") bench_cm_search_cmd(is); // 協力詰めの探索の再帰版と非再帰版の比較
+  else if (param == "cmorder") bench_cm_param(is, "order_depth", CooperativeMate::order_depth); // 協力詰めの指し手の並べ替えの効果
+  else if (param == "cmhistory") bench_cm_param(is, "history_depth", CooperativeMate::history_depth); // 協力詰めのhistoryの効果
+  else if (param == "cmleaf") bench_cm_leaf_cmd(is); // 協力詰めの末端の詰み判定のテスト
+#endif
   else {
     cout << "test unit          // UnitTest" << endl;
     cout << "test rp            // Random Player" << endl;
     cout << "test cm [depth]    // Cooperation Mate" << endl;
     cout << "test checks        // Generate Checks Test" << endl;
+    cout << "test countmoves [loop_max] // Count Moves Test & Benchmark" << endl;
+#ifdef MATE_1PLY
+    cout << "test mate1ply [loop_max] // Mate1Ply Test" << endl;
+#endif
+#ifdef COOPERATIVE_MATE_SOLVER
+    cout << "test cmtt [max_threads] [hash_mb] [ms] // CM TT Benchmark" << endl;
+    cout << "test cmtag [hash_mb] [probes] // CM TT Collision Rate" << endl;
+    cout << "test cmsearch [max_depth] // CM Search Recursive vs Nonrecursive" << endl;
+    cout << "test cmorder [sfen_file] // CM Move Ordering Benchmark" << endl;
+    cout << "test cmhistory [sfen_file] // CM History Benchmark" << endl;
+    cout << "test cmleaf [loop_max] // CM Leaf Solver Test" << endl;
+#endif
   }
 }
 
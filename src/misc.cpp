@@ -6,6 +6,19 @@
 #include "misc.h"
 #include "thread.h"
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 
 // --------------------
@@ -97,3 +110,225 @@ private:
 };
 
 void start_logger(bool b) { Logger::start(b); }
+
+// --------------------
+//  大きなメモリの確保
+// --------------------
+
+#ifdef __linux__
+
+// 確保したメモリをNUMA nodeをまたいでinterleaveして配置するようにOSに要求する。
+// libnumaに依存したくないのでmbindのsystem callを直接呼び出す。
+// NUMA nodeが1つしかないときやmbindが使えないときはfalseを返す。
+static bool numa_interleave(void* addr, size_t len)
+{
+  const int MPOL_INTERLEAVE_ = 3; // linux/mempolicy.hのMPOL_INTERLEAVE
+
+  // 存在するNUMA nodeを調べる。
+  uint64_t nodemask = 0;
+  for (int node = 0; node < 64; ++node)
+    if (access(("/sys/devices/system/node/node" + to_string(node)).c_str(), F_OK) == 0)
+      nodemask |= UINT64_C(1) << node;
+
+  if (POPCNT64(nodemask) <= 1)
+    return false;
+
+  return syscall(SYS_mbind, addr, len, MPOL_INTERLEAVE_, &nodemask, 64 + 1, 0) == 0;
+}
+
+#endif
+
+void* LargeMemory::alloc(size_t size, size_t alignment, bool interleave)
+{
+  free();
+
+  // 返す先頭アドレス
+  uintptr_t base;
+
+#ifdef __linux__
+
+  // sizeをunitの倍数に切り上げる。
+  auto round_up = [](size_t size, size_t unit) { return (size + unit - 1) / unit * unit; };
+
+  const size_t MB = 1024 * 1024;
+
+  // huge pageを予約してあれば(/proc/sys/vm/nr_hugepagesなど)、MAP_HUGETLBで確保できる。
+  // 1GB pageはsizeが1GBに満たないときは無駄が多いので使わない。
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+  for (size_t huge : { 1024 * MB, 2 * MB })
+  {
+    if (size < huge || alignment > huge)
+      continue;
+
+    const int log2_huge = (huge == 1024 * MB) ? 30 : 21;
+    const size_t sz = round_up(size, huge);
+    void* p = mmap(nullptr, sz, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (log2_huge << MAP_HUGE_SHIFT), -1, 0);
+    if (p != MAP_FAILED)
+    {
+      mem = p;
+      mem_size = sz;
+      page_size = huge;
+      base = uintptr_t(p); // huge pageの境界にalignされている。
+      break;
+    }
+  }
+#endif
+
+  // huge pageで確保できなかったので通常のpageで確保する。
+  // Transparent Huge Pageが使えるように2MB境界にalignしておく。
+  if (!mem)
+  {
+    const size_t align = std::max(alignment, 2 * MB);
+    const size_t sz = round_up(size, 2 * MB) + align;
+    void* p = mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return nullptr;
+
+    mem = p;
+    mem_size = sz;
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    // madviseした範囲がそのまま使われるように、2MB境界にalignした先頭アドレスを返す。
+    base = (uintptr_t(p) + align - 1) & ~(align - 1);
+#ifdef MADV_HUGEPAGE
+    transparent = madvise((void*)base, round_up(size, 2 * MB), MADV_HUGEPAGE) == 0;
+#endif
+  }
+
+  mmapped = true;
+
+  // pageに触れる前にmbindしておかないと意味がない。
+  if (interleave)
+    interleaved = numa_interleave(mem, mem_size);
+
+#else
+
+  // huge pageなどを使わない環境ではcallocで確保する。
+  mem = calloc(size + alignment - 1, 1);
+  if (!mem)
+    return nullptr;
+  mem_size = size + alignment - 1;
+  base = (uintptr_t(mem) + alignment - 1) & ~(alignment - 1);
+  (void)interleave;
+
+#endif
+
+  return (void*)base;
+}
+
+void* LargeMemory::map_file(const std::string& path, size_t size)
+{
+  free();
+
+#ifdef _WIN32
+
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return nullptr;
+
+  // CreateFileMapping()にsizeを渡すとファイルはそのサイズまで伸ばされるが、縮みはしないので先に合わせておく。
+  LARGE_INTEGER li;
+  li.QuadPart = (LONGLONG)size;
+  HANDLE mapping = nullptr;
+  if (SetFilePointerEx(file, li, nullptr, FILE_BEGIN) && SetEndOfFile(file))
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, li.HighPart, li.LowPart, nullptr);
+  void* p = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : nullptr;
+  if (!p)
+  {
+    if (mapping)
+      CloseHandle(mapping);
+    CloseHandle(file);
+    return nullptr;
+  }
+  file_handle = file;
+  mapping_handle = mapping;
+
+#else
+
+  int f = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (f < 0)
+    return nullptr;
+
+  struct stat st;
+  void* p = MAP_FAILED;
+  if (fstat(f, &st) == 0 && ((size_t)st.st_size == size || ftruncate(f, (off_t)size) == 0))
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+  if (p == MAP_FAILED)
+  {
+    close(f);
+    return nullptr;
+  }
+  fd = f;
+  page_size = (size_t)sysconf(_SC_PAGESIZE);
+  mmapped = true;
+
+#endif
+
+  mem = p;
+  mem_size = size;
+  file_path = path;
+  return p;
+}
+
+void LargeMemory::flush(bool wait)
+{
+  if (file_path.empty())
+    return;
+
+#ifdef _WIN32
+  FlushViewOfFile(mem, 0);
+  if (wait)
+    FlushFileBuffers((HANDLE)file_handle);
+#else
+  msync(mem, mem_size, wait ? MS_SYNC : MS_ASYNC);
+#endif
+}
+
+void LargeMemory::free()
+{
+#ifdef _WIN32
+  if (mapping_handle)
+  {
+    UnmapViewOfFile(mem);
+    CloseHandle((HANDLE)mapping_handle);
+    CloseHandle((HANDLE)file_handle);
+    mapping_handle = file_handle = nullptr;
+  }
+  else
+#else
+  if (mmapped)
+  {
+    munmap(mem, mem_size);
+    if (fd >= 0)
+      close(fd);
+    fd = -1;
+  }
+  else
+#endif
+    ::free(mem);
+
+  mem = nullptr;
+  mem_size = page_size = 0;
+  mmapped = transparent = interleaved = false;
+  file_path.clear();
+}
+
+string LargeMemory::page_info() const
+{
+  stringstream ss;
+  if (page_size >= 1024 * 1024)
+    ss << page_size / (1024 * 1024) << "MB huge page";
+  else if (page_size)
+    ss << page_size / 1024 << "KB page" << (transparent ? " + transparent huge page" : "");
+  else
+    ss << "default page";
+
+  if (!file_path.empty())
+    ss << " , mapped to " << file_path;
+
+  if (interleaved)
+    ss << " , NUMA interleaved";
+
+  return ss.str();
+}
@@ -56,6 +56,56 @@ inline void sleep(int ms)
   std::this_thread::sleep_for(std::chrono::microseconds(ms));
 }
 
+// --------------------
+//  大きなメモリの確保
+// --------------------
+
+// 置換表のような大きなメモリを確保するためのもの。確保したメモリは0クリアされている。
+// Linuxでは1GB/2MBのhuge page(mmapのMAP_HUGETLB)での確保を試み、できなければ通常のpageで
+// 確保してTransparent Huge Pageを要求する(madvise)。それ以外の環境ではcallocで確保する。
+struct LargeMemory
+{
+  // sizeバイト確保して、alignment(2のべき乗)でalignされた先頭アドレスを返す。
+  // 以前に確保していたメモリは開放される。確保に失敗したらnullptrが返る。
+  // interleave == trueなら、確保したメモリをNUMA nodeをまたいでinterleaveして配置するようにOSに要求する。
+  // falseならば、最初に書き込んだスレッドのnodeに配置される。(first-touch)
+  void* alloc(size_t size, size_t alignment, bool interleave);
+
+  // pathのファイルをsizeバイトにしてmemory mapし、その先頭アドレスを返す。以前に確保していたメモリは開放される。
+  // ファイルが既に存在すればその内容は保持される。(サイズが異なるときは切り詰めるか0で埋めて伸ばす)
+  // 先頭アドレスはpageの境界にalignされている。失敗したらnullptrが返る。
+  void* map_file(const std::string& path, size_t size);
+
+  // map_file()したメモリの内容をファイルに書き出す。wait == falseなら書き出しの完了を待たない。
+  void flush(bool wait);
+
+  // alloc()/map_file()で確保したメモリを開放する。
+  void free();
+
+  // 確保したメモリのpageの種類。"info string"での表示用。
+  std::string page_info() const;
+
+  LargeMemory() {}
+  ~LargeMemory() { free(); }
+  LargeMemory(const LargeMemory&) = delete;
+  LargeMemory& operator=(const LargeMemory&) = delete;
+
+private:
+  void* mem = nullptr;       // OSから確保したメモリの先頭
+  size_t mem_size = 0;       // OSから確保したメモリのサイズ
+  size_t page_size = 0;      // 確保したメモリのpageのサイズ。callocで確保したときは0。
+  bool mmapped = false;      // mmapで確保したのか
+  bool transparent = false;  // Transparent Huge Pageを要求したのか
+  bool interleaved = false;  // NUMA nodeをまたいだinterleaveを要求したのか
+  std::string file_path;     // map_file()したファイル名
+#ifdef _WIN32
+  void* file_handle = nullptr;    // map_file()したファイルのHANDLE
+  void* mapping_handle = nullptr; // file mapping objectのHANDLE
+#else
+  int fd = -1;               // map_file()したファイルのfile descriptor
+#endif
+};
+
 // --------------------
 //       乱数
 // --------------------
@@ -109,13 +109,56 @@ template <Piece Pt, Color Us, bool All> struct make_move_target {
 
     return mlist;
   }
+
+  // operator()で生成される指し手の数だけを返す。(countMoves用)
+  static int count(Square from, const Bitboard& target)
+  {
+    // 王手回避のときなどはtargetが空であることが多いので先に調べておく。
+    if (!target)
+      return 0;
+
+    switch (Pt)
+    {
+    case PAWN:
+      {
+        Square to = from + (Us == BLACK ? DELTA_S : DELTA_N);
+        return (canPromote(Us, to) && All && rank_of(to) != (Us == BLACK ? RANK_1 : RANK_9)) ? 2 : 1;
+      }
+
+    case LANCE:
+      return (target & enemy_field(Us)).pop_count()
+        + (target & (All ? (Us == BLACK ? InFrontBB[WHITE][RANK_1] : InFrontBB[BLACK][RANK_9]) :
+        (Us == BLACK ? InFrontBB[WHITE][RANK_2] : InFrontBB[BLACK][RANK_8]))).pop_count();
+
+    case KNIGHT:
+      // 3段目以降には不成で移動できる
+      return (target & enemy_field(Us)).pop_count()
+        + (target & (Us == BLACK ? InFrontBB[WHITE][RANK_2] : InFrontBB[BLACK][RANK_8])).pop_count();
+
+    case SILVER:
+      if (enemy_field(Us) & from)
+        return target.pop_count() * 2;
+      return (target & enemy_field(Us)).pop_count() * 2 + (target & ~enemy_field(Us)).pop_count();
+
+    case GOLD: case PRO_PAWN: case PRO_LANCE: case PRO_KNIGHT: case PRO_SILVER: case HORSE: case DRAGON: case KING: case GPM_GHDK:
+      return target.pop_count();
+
+    case BISHOP: case ROOK: case GPM_BR:
+      if (canPromote(Us, from))
+        return target.pop_count() * (All ? 2 : 1);
+      return (target & enemy_field(Us)).pop_count() * (All ? 2 : 1) + (target & ~enemy_field(Us)).pop_count();
+
+    default: UNREACHABLE; return 0;
+    }
+  }
 };
 
 // 指し手生成のうち、一般化されたもの。香・桂・銀はこの指し手生成を用いる。
+// movable = 動かしても良い自駒。(合法な回避手の生成でpinされている駒を除くのに使う)
 template <MOVE_GEN_TYPE GenType, Piece Pt, Color Us, bool All> struct GeneratePieceMoves {
-  ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target) {
+  ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target, const Bitboard& movable = ALL_BB) {
     // 盤上の駒pc(香・桂・銀)に対して
-    auto pieces = pos.pieces(Us, Pt);
+    auto pieces = pos.pieces(Us, Pt) & movable;
     const auto occ = pos.pieces();
 
     while (pieces)
@@ -135,14 +178,34 @@ template <MOVE_GEN_TYPE GenType, Piece Pt, Color Us, bool All> struct GeneratePi
 
     return mlist;
   }
+
+  // operator()で生成される指し手の数だけを返す。
+  static int count(const Position&pos, const Bitboard& target, const Bitboard& movable = ALL_BB) {
+    auto pieces = pos.pieces(Us, Pt) & movable;
+    const auto occ = pos.pieces();
+    int n = 0;
+
+    while (pieces)
+    {
+      auto from = pieces.pop();
+      auto target2 =
+        Pt == LANCE ? lanceEffect(Us, from, occ) :
+        Pt == KNIGHT ? knightEffect(Us, from) :
+        Pt == SILVER ? silverEffect(Us, from) :
+        ALL_BB; // error
+
+      n += make_move_target<Pt, Us, All>::count(from, target2 & target);
+    }
+    return n;
+  }
 };
 
 // 歩の移動による指し手生成
 template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<GenType, PAWN, Us, All> {
-  ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target)
+  ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target, const Bitboard& movable = ALL_BB)
   {
     // 盤上の自駒の歩に対して
-    auto pieces = pos.pieces(Us, PAWN);
+    auto pieces = pos.pieces(Us, PAWN) & movable;
 
     // Apery型の縦型Bitboardにおいては歩の利きはbit shiftで済む。
     auto target2 = (Us == BLACK ? (pieces >> 1) : (pieces << 1) ) & target;
@@ -168,14 +231,26 @@ template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<G
     }
     return mlist;
   }
+
+  // operator()で生成される指し手の数だけを返す。
+  // 敵陣では成りが1手、Allなら1段目以外は不成がもう1手。敵陣以外では不成の1手のみ。
+  static int count(const Position&pos, const Bitboard& target, const Bitboard& movable = ALL_BB)
+  {
+    auto pieces = pos.pieces(Us, PAWN) & movable;
+    auto target2 = (Us == BLACK ? (pieces >> 1) : (pieces << 1)) & target;
+    int n = target2.pop_count();
+    if (All)
+      n += (target2 & enemy_field(Us) & ~(Us == BLACK ? RANK1_BB : RANK9_BB)).pop_count();
+    return n;
+  }
 };
 
 // 角・飛による移動による指し手生成。これらの駒は成れるなら絶対に成る
 template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<GenType, GPM_BR, Us, All> {
-  ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target)
+  ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target, const Bitboard& movable = ALL_BB)
   {
     // 角と飛に対して(馬と龍は除く)
-    auto pieces = (pos.pieces(Us, BISHOP) | pos.pieces(Us, ROOK)) & ~pos.pieces(Us, HDK);
+    auto pieces = (pos.pieces(Us, BISHOP) | pos.pieces(Us, ROOK)) & ~pos.pieces(Us, HDK) & movable;
     auto occ = pos.pieces();
 
     while (pieces)
@@ -189,6 +264,21 @@ template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<G
     }
     return mlist;
   }
+
+  // operator()で生成される指し手の数だけを返す。
+  static int count(const Position&pos, const Bitboard& target, const Bitboard& movable = ALL_BB)
+  {
+    auto pieces = (pos.pieces(Us, BISHOP) | pos.pieces(Us, ROOK)) & ~pos.pieces(Us, HDK) & movable;
+    auto occ = pos.pieces();
+    int n = 0;
+
+    while (pieces)
+    {
+      auto from = pieces.pop();
+      n += make_move_target<GPM_BR, Us, All>::count(from, effects_from(pos.piece_on(from), from, occ) & target);
+    }
+    return n;
+  }
 };
 
 // 成れない駒による移動による指し手。(金相当の駒・馬・龍・王)
@@ -209,14 +299,29 @@ template <MOVE_GEN_TYPE GenType, Color Us,bool All> struct GeneratePieceMoves<Ge
     }
     return mlist;
   }
+
+  // operator()で生成される指し手の数だけを返す。(成れない駒なので利きの升の数そのもの)
+  static int count(const Position&pos, const Bitboard& target)
+  {
+    auto pieces = pos.pieces(Us, HDK) | pos.pieces(Us, GOLD);
+    auto occ = pos.pieces();
+    int n = 0;
+
+    while (pieces)
+    {
+      auto from = pieces.pop();
+      n += (effects_from(pos.piece_on(from), from, occ) & target).pop_count();
+    }
+    return n;
+  }
 };
 
 // 玉を除く成れない駒による移動による指し手。(金相当の駒・馬・龍)
 template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<GenType, GPM_GHD, Us, All> {
-  ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target)
+  ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target, const Bitboard& movable = ALL_BB)
   {
     // 金相当の駒・馬・龍に対して
-    auto pieces = (pos.pieces(Us, HDK) | pos.pieces(Us, GOLD)) ^ pos.king_square(Us);
+    auto pieces = ((pos.pieces(Us, HDK) | pos.pieces(Us, GOLD)) ^ pos.king_square(Us)) & movable;
     auto occ = pos.pieces();
     Square to;
 
@@ -230,10 +335,26 @@ template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<G
     }
     return mlist;
   }
+
+  // operator()で生成される指し手の数だけを返す。
+  static int count(const Position&pos, const Bitboard& target, const Bitboard& movable = ALL_BB)
+  {
+    auto pieces = ((pos.pieces(Us, HDK) | pos.pieces(Us, GOLD)) ^ pos.king_square(Us)) & movable;
+    auto occ = pos.pieces();
+    int n = 0;
+
+    while (pieces)
+    {
+      auto from = pieces.pop();
+      n += (effects_from(pos.piece_on(from), from, occ) & target).pop_count();
+    }
+    return n;
+  }
 };
 
 // 手番側が王手がかかっているときに、王手を回避する手を生成する。
-template<Color US, bool All>
+// Legal == trueなら自殺手を生成しない。(LEGAL_EVASIONS,LEGAL_EVASIONS_ALL)
+template<Color US, bool All, bool Legal = false>
   ExtMove* generate_evasions(const Position& pos, ExtMove* mlist)
   {
     // この実装において引数のtargetは無視する。
@@ -279,7 +400,21 @@ template<Color US, bool All>
     // これがまだ自殺手である可能性もあるが、それはis_legal()でチェックすればいいと思う。
 
     Bitboard bb = kingEffect(ksq) & ~pos.pieces(US) & ~sliderAttacks;
-    while (bb) { Square to = bb.pop(); mlist++->move = make_move(ksq, to); }
+    if (!Legal)
+      while (bb) { Square to = bb.pop(); mlist++->move = make_move(ksq, to); }
+    else
+      while (bb)
+      {
+        Square to = bb.pop();
+#ifdef MATE_1PLY
+        // 差分更新している相手の利きを見る。自玉で遮られている相手の利きは王手している駒のものだけなので、
+        // sliderAttacks(玉がないものとして求めてある)を除いたあとは、利きの数が0の升だけが安全。
+        if (!pos.board_effect(~US).count(to))
+#else
+        if (!pos.attackers_to(~US, to, occ))
+#endif
+          mlist++->move = make_move(ksq, to);
+      }
 
     // 両王手であるなら、王の移動のみが回避手となる。ゆえにこれで指し手生成は終了。
     if (checkersCnt > 1)
@@ -298,13 +433,18 @@ template<Color US, bool All>
     const Bitboard target1 = between_bb(checksq, ksq);
     const Bitboard target2 = target1 | checksq;
 
+    // pinされている駒は、王手している駒を取ることも合駒することもできない。
+    // (pinの直線と王手の直線は玉の升でしか交わらないので、pinの直線に沿った移動では王手を回避できない)
+    // ゆえに、Legalのときはpinされている駒をはじめから動かさない。
+    const Bitboard movable = Legal ? ~pos.pinned_pieces(US) : ALL_BB;
+
     // あとはNON_EVASIONS扱いで普通に指し手生成。
-    mlist = GeneratePieceMoves<NON_EVASIONS, PAWN, US, All>()(pos, mlist, target2);
-    mlist = GeneratePieceMoves<NON_EVASIONS, LANCE, US, All>()(pos, mlist, target2);
-    mlist = GeneratePieceMoves<NON_EVASIONS, KNIGHT, US, All>()(pos, mlist, target2);
-    mlist = GeneratePieceMoves<NON_EVASIONS, SILVER, US, All>()(pos, mlist, target2);
-    mlist = GeneratePieceMoves<NON_EVASIONS, GPM_BR, US, All>()(pos, mlist, target2);
-    mlist = GeneratePieceMoves<NON_EVASIONS, GPM_GHD, US, All>()(pos, mlist, target2); // 玉は除かないといけない
+    mlist = GeneratePieceMoves<NON_EVASIONS, PAWN, US, All>()(pos, mlist, target2, movable);
+    mlist = GeneratePieceMoves<NON_EVASIONS, LANCE, US, All>()(pos, mlist, target2, movable);
+    mlist = GeneratePieceMoves<NON_EVASIONS, KNIGHT, US, All>()(pos, mlist, target2, movable);
+    mlist = GeneratePieceMoves<NON_EVASIONS, SILVER, US, All>()(pos, mlist, target2, movable);
+    mlist = GeneratePieceMoves<NON_EVASIONS, GPM_BR, US, All>()(pos, mlist, target2, movable);
+    mlist = GeneratePieceMoves<NON_EVASIONS, GPM_GHD, US, All>()(pos, mlist, target2, movable); // 玉は除かないといけない
     mlist = GenerateDropMoves<US>()(pos, mlist, target1);
 
     return mlist;
@@ -455,6 +595,55 @@ template <Color US> struct GenerateDropMoves {
 
     return mlist;
   }
+
+  // operator()で生成される指し手の数だけを返す。
+  // 歩以外は、打てる段ごとに「打てる駒の種類数 × 升の数」になる。
+  static int count(const Position&pos, const Bitboard& target) {
+
+    const Hand hand = pos.hand_of(US);
+    if (hand == 0)
+      return 0;
+
+    const HandKind hk = toHandKind(hand);
+    int n = 0;
+
+    // --- 歩を打つ指し手の数(二歩と打ち歩詰めの除外はoperator()と同じ)
+    if (hand_exists(hk, PAWN))
+    {
+      Bitboard a = pos.pieces(US, PAWN) + rank1_n_bb(BLACK, RANK_8);
+      uint32_t index = uint32_t(PEXT64(a.p[0], RANK9_BB.p[0]) + (PEXT64(a.p[1], RANK9_BB.p[1]) << 7));
+      Bitboard target2 = PAWN_DROP_MASK_BB[index][US] & target;
+
+      Bitboard pe = pawnEffect(~pos.side_to_move(), pos.king_square(~pos.side_to_move()));
+      if (pe & target2)
+      {
+        Square to = pe.pop_c();
+        if (!pos.legal_drop(to))
+          target2 ^= pe;
+      }
+      n += target2.pop_count();
+    }
+
+    // --- 歩以外を打つ指し手の数
+    if (hand_exceptPawnExists(hk))
+    {
+      const int knight = hand_exists(hk, KNIGHT) ? 1 : 0;
+      const int lance = hand_exists(hk, LANCE) ? 1 : 0;
+      const int others = (hand_exists(hk, SILVER) ? 1 : 0) + (hand_exists(hk, GOLD) ? 1 : 0)
+        + (hand_exists(hk, BISHOP) ? 1 : 0) + (hand_exists(hk, ROOK) ? 1 : 0);
+
+      if (knight + lance == 0)
+        n += others * target.pop_count();
+      else
+      {
+        n += others * (target & rank1_n_bb(US, RANK_1)).pop_count(); // 1段目
+        n += (others + lance) * (target & (US == BLACK ? RANK2_BB : RANK8_BB)).pop_count(); // 2段目
+        n += (others + lance + knight) * (target & rank1_n_bb(~US, RANK_7)).pop_count(); // 3～9段目
+      }
+    }
+
+    return n;
+  }
 };
 
 // ----------------------------------
@@ -516,6 +705,98 @@ ExtMove* generate_general(const Position& pos, ExtMove* mlist)
   return mlist;
 }
 
+// ----------------------------------
+//      指し手の数だけを数える
+// ----------------------------------
+
+// generate_general()と同じ指し手の集合について、その数だけを返す。
+// 指し手をバッファに書き出さずに、移動先のbitboardのpopcountで数える。
+template<MOVE_GEN_TYPE GenType, Color Us, bool All>
+int count_general(const Position& pos)
+{
+  const Bitboard target =
+    (GenType == NON_CAPTURES) ? pos.empties() :
+    (GenType == CAPTURES) ? pos.pieces(~Us) :
+    (GenType == NON_CAPTURES_PRO_MINUS) ? pos.empties() :
+    (GenType == CAPTURES_PRO_PLUS) ? pos.pieces(~Us) :
+    (GenType == NON_EVASIONS) ? ~pos.pieces(Us) :
+    ALL_BB; // error
+
+  const Bitboard targetPawn =
+    (GenType == NON_CAPTURES_PRO_MINUS) ? (pos.empties() & ~enemy_field(Us)) :
+    (GenType == CAPTURES_PRO_PLUS) ? (pos.pieces(~Us) | enemy_field(Us)) :
+    target;
+
+  int n = GeneratePieceMoves<GenType, PAWN, Us, All>::count(pos, targetPawn)
+    + GeneratePieceMoves<GenType, LANCE, Us, All>::count(pos, target)
+    + GeneratePieceMoves<GenType, KNIGHT, Us, All>::count(pos, target)
+    + GeneratePieceMoves<GenType, SILVER, Us, All>::count(pos, target)
+    + GeneratePieceMoves<GenType, GPM_BR, Us, All>::count(pos, target)
+    + GeneratePieceMoves<GenType, GPM_GHDK, Us, All>::count(pos, target);
+
+  if (GenType == NON_CAPTURES || GenType == NON_CAPTURES_PRO_MINUS || GenType == NON_EVASIONS)
+    n += GenerateDropMoves<Us>::count(pos, pos.empties());
+
+  return n;
+}
+
+// generate_evasions()と同じ指し手の集合について、その数だけを返す。
+// 王手している駒と玉の移動先を求める部分はgenerate_evasions()と共通で、回避手は数も少ないので、
+// 指し手を書き出さない分しか得をしない。MoveList<EVASIONS>::size()とほぼ同じ速さ。(test countmoves)
+template<Color US, bool All, bool Legal = false>
+int count_evasions(const Position& pos)
+{
+  ASSERT_LV2(pos.in_check());
+
+  Bitboard sliderAttacks = ZERO_BB;
+  Bitboard checkers = pos.checkers();
+  int checkersCnt = 0;
+
+  Square ksq = pos.king_square(US);
+  Bitboard occ = pos.pieces() ^ Bitboard(ksq);
+  Square checksq;
+
+  do
+  {
+    ++checkersCnt;
+    checksq = checkers.pop();
+    sliderAttacks |= effects_from(pos.piece_on(checksq), checksq, occ);
+  } while (checkers);
+
+  // 玉の移動。Legalのときは1升ずつ相手の利きを調べる必要がある。
+  Bitboard bb = kingEffect(ksq) & ~pos.pieces(US) & ~sliderAttacks;
+  int n = 0;
+  if (!Legal)
+    n = bb.pop_count();
+  else
+    while (bb)
+    {
+      Square to = bb.pop();
+#ifdef MATE_1PLY
+      if (!pos.board_effect(~US).count(to))
+#else
+      if (!pos.attackers_to(~US, to, occ))
+#endif
+        ++n;
+    }
+
+  if (checkersCnt > 1)
+    return n;
+
+  const Bitboard target1 = between_bb(checksq, ksq);
+  const Bitboard target2 = target1 | checksq;
+  const Bitboard movable = Legal ? ~pos.pinned_pieces(US) : ALL_BB;
+
+  return n
+    + GeneratePieceMoves<NON_EVASIONS, PAWN, US, All>::count(pos, target2, movable)
+    + GeneratePieceMoves<NON_EVASIONS, LANCE, US, All>::count(pos, target2, movable)
+    + GeneratePieceMoves<NON_EVASIONS, KNIGHT, US, All>::count(pos, target2, movable)
+    + GeneratePieceMoves<NON_EVASIONS, SILVER, US, All>::count(pos, target2, movable)
+    + GeneratePieceMoves<NON_EVASIONS, GPM_BR, US, All>::count(pos, target2, movable)
+    + GeneratePieceMoves<NON_EVASIONS, GPM_GHD, US, All>::count(pos, target2, movable)
+    + GenerateDropMoves<US>::count(pos, target1);
+}
+
 // -----------------------------------------------------
 //     王手生成関係。(やねうら王nanoでは削除予定)
 // -----------------------------------------------------
@@ -682,7 +963,8 @@ template <Color Us> struct GenerateCheckDropMoves<Us, PAWN> {
 
 
 // 指し手の生成器本体(王手専用)
-template<Color Us, bool All>
+// Legal == trueなら自殺手を生成しない。(LEGAL_CHECKS,LEGAL_CHECKS_ALL。王手されていない局面専用)
+template<Color Us, bool All, bool Legal = false>
 ExtMove* generate_checks(const Position& pos, ExtMove* mlist)
 {
   // --- 駒の移動による王手
@@ -721,29 +1003,73 @@ ExtMove* generate_checks(const Position& pos, ExtMove* mlist)
   const Bitboard y = ci.dcCandidates;
   const Bitboard target = ~pos.pieces(Us); // 自駒がない場所が移動対象升
 
+  // Legalのとき、fromの駒を動かして自殺手にならない移動先。
+  // pinされている駒は自玉との直線上のみ。玉は相手の利きのない升のみ。(王手されていないので玉で遮られている相手の利きはない)
+  auto legal_target = [&](Square from) {
+    if (!Legal)
+      return target;
+    if (from == ourKing)
+    {
+      Bitboard bb = kingEffect(from) & target, safe = ZERO_BB;
+      while (bb)
+      {
+        const Square to = bb.pop();
+#ifdef MATE_1PLY
+        if (!pos.board_effect(~Us).count(to))
+#else
+        if (!pos.effected_to(~Us, to))
+#endif
+          safe |= to;
+      }
+      return safe;
+    }
+    return (ci.pinned & from) ? target & line_bb(ourKing, from) : target;
+  };
+
   // yのみ。ただしxかつyである可能性もある。
   auto src = y;
   while (src)
   {
     auto from = src.pop();
+    const Bitboard target2 = legal_target(from);
 
     // 両王手候補なので指し手を生成してしまう。
     auto pin_line = line_bb(themKing, from); // いまの敵玉とfromを通る線上と違うところに移動させれば開き王手確定
-    mlist = make_move_target_general<Us, All>()(pos, pos.piece_on(from), from, target & ~pin_line, mlist);
+    auto first = mlist;
+    mlist = make_move_target_general<Us, All>()(pos, pos.piece_on(from), from, target2 & ~pin_line, mlist);
+
+    // Legalのときは王手している駒を記録する。(LEGAL_CHECKS用)
+    // fromを空けて敵玉に利くようになるpin_line上の自駒による開き王手で、移動先によっては直接王手にもなる。
+    if (Legal)
+    {
+      const Square dc = (pos.attackers_to(Us, themKing, pos.pieces() ^ from) & pin_line & ~Bitboard(from)).pop_c();
+      const Piece pt = type_of(pos.piece_on(from));
+      for (auto it = first; it != mlist; ++it)
+        it->checkers = make_checkers(ci.checkSq[is_promote(it->move) ? pt + PIECE_PROMOTE : pt] & move_to(it->move), dc);
+    }
 
     if (x & from)
+    {
       // 直接王手にもなるので↑で生成した~line_bb以外の升への指し手を生成。
-      mlist = make_move_check<Us, All>(pos, pos.piece_on(from), from, themKing, target & pin_line, mlist);
+      first = mlist;
+      mlist = make_move_check<Us, All>(pos, pos.piece_on(from), from, themKing, target2 & pin_line, mlist);
+
+      // pin_line上の移動なので開き王手にはならない。
+      if (Legal)
+        for (auto it = first; it != mlist; ++it)
+          it->checkers = make_checkers(true, SQ_NB);
+    }
   }
 
   // yに被覆しないx
+  auto direct_first = mlist;
   src = (x | y) ^ y;
   while (src)
   {
     auto from = src.pop();
 
     // 直接王手のみ。
-    mlist = make_move_check<Us, All>(pos,pos.piece_on(from), from, themKing, target, mlist);
+    mlist = make_move_check<Us, All>(pos,pos.piece_on(from), from, themKing, legal_target(from), mlist);
   }
 
   // --- 駒打ちによる王手
@@ -766,6 +1092,11 @@ ExtMove* generate_checks(const Position& pos, ExtMove* mlist)
   if (hand_exists(h, ROOK))
     mlist = GenerateCheckDropMoves<Us, ROOK>()(pos, ci.checkSq[ROOK] & empties, mlist);
 
+  // yに被覆しないxの移動と駒打ちは直接王手のみ。
+  if (Legal)
+    for (auto it = direct_first; it != mlist; ++it)
+      it->checkers = make_checkers(true, SQ_NB);
+
   return mlist;
 }
 
@@ -782,17 +1113,38 @@ ExtMove* generateMoves(const Position& pos, ExtMove* mlist)
 }
 
 // 同じく、Evasionsの指し手生成を呼ぶための踏み台
-template<bool All>
+template<bool All, bool Legal = false>
 ExtMove* generateEvasionMoves(const Position& pos, ExtMove* mlist)
 {
-  return pos.side_to_move() == BLACK ? generate_evasions<BLACK, All>(pos, mlist) : generate_evasions<WHITE, All>(pos, mlist);
+  return pos.side_to_move() == BLACK ? generate_evasions<BLACK, All, Legal>(pos, mlist) : generate_evasions<WHITE, All, Legal>(pos, mlist);
 }
 
 // 同じく、Checksの指し手生成を呼ぶための踏み台
-template<bool All>
+template<bool All, bool Legal = false>
 ExtMove* generateChecksMoves(const Position& pos, ExtMove* mlist)
 {
-  return pos.side_to_move() == BLACK ? generate_checks<BLACK, All>(pos, mlist) : generate_checks<WHITE, All>(pos, mlist);
+  return pos.side_to_move() == BLACK ? generate_checks<BLACK, All, Legal>(pos, mlist) : generate_checks<WHITE, All, Legal>(pos, mlist);
+}
+
+// 指し手mで王手している駒をmake_checkers()の形式で返す。(position.hで宣言)
+uint16_t make_checkers(const Position& pos, Move m)
+{
+  const CheckInfo& ci = pos.state()->checkInfo;
+  const Square to = move_to(m);
+
+  if (is_drop(m))
+    return make_checkers(ci.checkSq[move_dropped_piece(m)] & to, SQ_NB);
+
+  const Square from = move_from(m);
+  const Piece pt = (Piece)(type_of(pos.piece_on(from)) + (is_promote(m) ? PIECE_PROMOTE : 0));
+  const bool direct = ci.checkSq[pt] & to;
+
+  // 開き王手なら、fromを空けて敵玉に利くようになる自駒がもう一つの王手している駒。
+  Square dc = SQ_NB;
+  if (pos.discovered(from, to, ci.ksq, ci.dcCandidates))
+    dc = (pos.attackers_to(pos.side_to_move(), ci.ksq, pos.pieces() ^ from) & line_bb(ci.ksq, from) & ~Bitboard(from)).pop_c();
+
+  return make_checkers(direct, dc);
 }
 
 
@@ -802,7 +1154,8 @@ template<MOVE_GEN_TYPE GenType>
 ExtMove* generateMoves(const Position& pos, ExtMove* mlist)
 {
   // すべての指し手を生成するのか。
-  const bool All = (GenType == EVASIONS_ALL) || (GenType == CHECKS_ALL) || (GenType == LEGAL_ALL);
+  const bool All = (GenType == EVASIONS_ALL) || (GenType == CHECKS_ALL) || (GenType == LEGAL_ALL)
+    || (GenType == LEGAL_EVASIONS_ALL) || (GenType == LEGAL_CHECKS_ALL);
   if (GenType == LEGAL || GenType == LEGAL_ALL)
   {
     // LEGALだけは特殊な状況で用いるので、呼び出し元でcheck_info_update()は呼び出しされていないはずなのでここで呼び出しておく。
@@ -841,14 +1194,62 @@ ExtMove* generateMoves(const Position& pos, ExtMove* mlist)
     return last;
   }
 
+  // 合法な王手
+  if (GenType == LEGAL_CHECKS || GenType == LEGAL_CHECKS_ALL)
+  {
+    ExtMove* last;
+    if (!pos.in_check())
+      last = generateChecksMoves<All, true>(pos, mlist);
+    else
+    {
+      // 王手がかかっている局面では、合法な回避手のうち王手になるものを選ぶ。これはレアケースなので少々の無駄は許容する。
+      // 王手している駒はgenerate_checks()では生成時に記録するが、こちらは後から求める。
+      last = generateEvasionMoves<All, true>(pos, mlist);
+      for (auto it = mlist; it != last; )
+      {
+        if (!pos.gives_check(it->move))
+          it->move = (--last)->move;
+        else
+        {
+          it->checkers = make_checkers(pos, it->move);
+          ++it;
+        }
+      }
+    }
+    return last;
+  }
+
   // 回避手
   if (GenType == EVASIONS || GenType == EVASIONS_ALL)
     return generateEvasionMoves<All>(pos, mlist);
 
+  // 合法な回避手
+  if (GenType == LEGAL_EVASIONS || GenType == LEGAL_EVASIONS_ALL)
+    return generateEvasionMoves<All, true>(pos, mlist);
+
   // 上記のもの以外
   return generateMoves<GenType, All>(pos, mlist);
 }
 
+// 指し手の数だけを返す。MoveList<GenType>(pos).size()と同じ値になる。
+// LEGAL,LEGAL_ALLのようにpos.legal()で後から除外する指し手生成と、王手生成には対応していない。
+template<MOVE_GEN_TYPE GenType>
+int countMoves(const Position& pos)
+{
+  static_assert(GenType != LEGAL && GenType != LEGAL_ALL && GenType != CHECKS && GenType != CHECKS_ALL
+    && GenType != LEGAL_CHECKS && GenType != LEGAL_CHECKS_ALL, "countMoves() does not support this GenType.");
+
+  const bool All = (GenType == EVASIONS_ALL) || (GenType == LEGAL_EVASIONS_ALL);
+  const bool Legal = (GenType == LEGAL_EVASIONS) || (GenType == LEGAL_EVASIONS_ALL);
+  const bool Evasions = (GenType == EVASIONS) || (GenType == EVASIONS_ALL) || Legal;
+  const Color us = pos.side_to_move();
+
+  if (Evasions)
+    return us == BLACK ? count_evasions<BLACK, All, Legal>(pos) : count_evasions<WHITE, All, Legal>(pos);
+
+  return us == BLACK ? count_general<GenType, BLACK, All>(pos) : count_general<GenType, WHITE, All>(pos);
+}
+
 // テンプレートの実体化。これを書いておかないとリンクエラーになる。
 // .h(ヘッダー)ではなく.cppのほうに書くことでコンパイル時間を節約できる。
 
@@ -862,11 +1263,15 @@ template ExtMove* generateMoves<CAPTURES_PRO_PLUS     >(const Position& pos, Ext
 
 template ExtMove* generateMoves<EVASIONS              >(const Position& pos, ExtMove* mlist);
 
+template ExtMove* generateMoves<LEGAL_EVASIONS        >(const Position& pos, ExtMove* mlist);
+
 #ifdef COOPERATIVE_MATE_SOLVER
 // 協力詰めのときは必要
 template ExtMove* generateMoves<EVASIONS_ALL          >(const Position& pos, ExtMove* mlist);
+template ExtMove* generateMoves<LEGAL_EVASIONS_ALL    >(const Position& pos, ExtMove* mlist);
 #else
 //template ExtMove* generateMoves<EVASIONS_ALL          >(const Position& pos, ExtMove* mlist);
+//template ExtMove* generateMoves<LEGAL_EVASIONS_ALL    >(const Position& pos, ExtMove* mlist);
 #endif
 template ExtMove* generateMoves<NON_EVASIONS          >(const Position& pos, ExtMove* mlist);
 
@@ -876,3 +1281,16 @@ template ExtMove* generateMoves<LEGAL_ALL             >(const Position& pos, Ext
 // 王手の指し手生成(詰将棋探索等を用いないなら不要)
 template ExtMove* generateMoves<CHECKS                >(const Position& pos, ExtMove* mlist);
 template ExtMove* generateMoves<CHECKS_ALL            >(const Position& pos, ExtMove* mlist);
+template ExtMove* generateMoves<LEGAL_CHECKS          >(const Position& pos, ExtMove* mlist);
+template ExtMove* generateMoves<LEGAL_CHECKS_ALL      >(const Position& pos, ExtMove* mlist);
+
+// 指し手の数だけを数えるもの
+template int countMoves<NON_CAPTURES_PRO_MINUS>(const Position& pos);
+template int countMoves<CAPTURES_PRO_PLUS     >(const Position& pos);
+template int countMoves<EVASIONS              >(const Position& pos);
+template int countMoves<LEGAL_EVASIONS        >(const Position& pos);
+template int countMoves<NON_EVASIONS          >(const Position& pos);
+#ifdef COOPERATIVE_MATE_SOLVER
+template int countMoves<EVASIONS_ALL          >(const Position& pos);
+template int countMoves<LEGAL_EVASIONS_ALL    >(const Position& pos);
+#endif
@@ -92,6 +92,15 @@ void Position::init() {
 // depthに応じたZobrist Hashを得る。depthを含めてhash keyを求めたいときに用いる。
 HASH_KEY DepthHash(int depth) { return Zobrist::depth[depth]; }
 
+// c側の手駒hのZobrist Hashを得る。
+HASH_KEY HandHash(Color c, Hand h)
+{
+  HASH_KEY key = Zobrist::zero;
+  for (Piece pr = PAWN; pr < PIECE_HAND_NB; ++pr)
+    key += Zobrist::hand[c][pr] * (int64_t)hand_count(h, pr);
+  return key;
+}
+
 // ----------------------------------
 //  Position::set()とその逆変換sfen()
 // ----------------------------------
@@ -241,6 +250,12 @@ void Position::set(std::string sfen)
 
   set_state(st);
 
+#ifdef MATE_1PLY
+  // --- 利き
+
+  set_effect();
+#endif
+
   // --- evaluate
 
   st->materialValue = Eval::material(*this);
@@ -539,6 +554,147 @@ bool Position::is_mated() const
   return MoveList<LEGAL>(*this).size() == 0;
 }
 
+// 王手をかけられている手番側に、王手を回避する合法手があるか。
+// 玉の移動、王手している駒を取る手、合駒(移動、打つ手)の順に調べて、1つ見つけた時点で返す。
+bool Position::has_legal_evasion() const
+{
+  ASSERT_LV3(in_check());
+
+  const Color us = sideToMove, them = ~us;
+  const Square ksq = king_square(us);
+
+  // 1) 玉の移動。玉がいないものとして利きを調べる。(王手している飛び駒の利きの延長線上に逃げられないように)
+  const Bitboard occ = pieces() ^ ksq;
+  Bitboard bb = kingEffect(ksq) & ~pieces(us);
+  while (bb)
+    if (!attackers_to(them, bb.pop(), occ))
+      return true;
+
+  // 両王手なら玉の移動以外に回避手はない。
+  Bitboard checkers = st->checkersBB;
+  const Square checksq = checkers.pop();
+  if (checkers)
+    return false;
+
+  // 2) 王手している駒を玉以外で取る手と、移動合い。pinされている駒は王との直線上への移動のみ。
+  const Bitboard pinned = pinned_pieces(us);
+  const Bitboard between = between_bb(checksq, ksq);
+  bb = between | checksq;
+  while (bb)
+  {
+    const Square to = bb.pop();
+    Bitboard from_bb = attackers_to(us, to) & ~Bitboard(ksq);
+    while (from_bb)
+      if (!discovered(from_bb.pop(), to, ksq, pinned))
+        return true;
+  }
+
+  // 3) 合駒を打つ手。行き所のない駒と、二歩・打ち歩詰めの歩は打てない。
+  const Hand h = hand[us];
+  if (!between || h == HAND_ZERO)
+    return false;
+  if (hand_exists(h, SILVER) || hand_exists(h, GOLD) || hand_exists(h, BISHOP) || hand_exists(h, ROOK))
+    return true;
+  if (hand_exists(h, LANCE) && (between & ~rank1_n_bb(us, RANK_1)))
+    return true;
+  if (hand_exists(h, KNIGHT) && (between & ~rank1_n_bb(us, RANK_2)))
+    return true;
+  if (hand_exists(h, PAWN))
+  {
+    bb = between & ~rank1_n_bb(us, RANK_1);
+    while (bb)
+    {
+      const Square to = bb.pop();
+      if (FILE_BB[file_of(to)] & pieces(us, PAWN))
+        continue;
+      // 相手玉の頭に打つ歩だけ、打ち歩詰めを調べる。
+      if ((pawnEffect(us, to) & king_square(them)) && !legal_drop(to))
+        continue;
+      return true;
+    }
+  }
+  return false;
+}
+
+// 手番側に、相手玉に王手をかける合法手があるか。
+// 駒打ち、駒の移動による直接王手、開き王手の順に調べて、1つ見つけた時点で返す。
+bool Position::has_legal_check() const
+{
+  const Color us = sideToMove, them = ~us;
+  const Square ksq = king_square(them);
+  if (ksq == SQ_NB)
+    return false;
+
+  // 王手されているときは、回避手のうち王手になるものを探す。(協力詰めではレアケースなので指し手生成で済ませる)
+  if (in_check())
+  {
+    ExtMove moves[MAX_MOVES];
+    const ExtMove* last = generateMoves<EVASIONS_ALL>(*this, moves);
+    for (auto it = moves; it != last; ++it)
+      if (gives_check(it->move) && legal(it->move))
+        return true;
+    return false;
+  }
+
+  const CheckInfo& ci = st->checkInfo;
+
+  // 1) 駒打ち。王手されていなければ打つ手はすべて合法。
+  // 歩・香・桂で王手になる升は、行き所のない駒になる段にはない。
+  const Hand h = hand[us];
+  if (h != HAND_ZERO)
+  {
+    const Bitboard emp = empties();
+    for (auto pt : { LANCE, KNIGHT, SILVER, GOLD, BISHOP, ROOK })
+      if (hand_exists(h, pt) && (ci.checkSq[pt] & emp))
+        return true;
+
+    const Bitboard bb = ci.checkSq[PAWN] & emp;
+    if (hand_exists(h, PAWN) && bb)
+    {
+      const Square to = Bitboard(bb).pop();
+      if (!(FILE_BB[file_of(to)] & pieces(us, PAWN)) && legal_drop(to))
+        return true;
+    }
+  }
+
+  // 2) 玉以外の駒の移動。成れるなら成った駒で王手になる升も調べる。
+  // 王手になる升が行き所のない駒になる段であっても、そこへは成る手があるので移動先としては合法。
+  const Square our_ksq = king_square(us);
+  const Bitboard occ = pieces();
+  Bitboard bb = pieces(us);
+  if (our_ksq != SQ_NB)
+    bb ^= our_ksq;
+  while (bb)
+  {
+    const Square from = bb.pop();
+    const Piece pc = piece_on(from);
+    const Piece pt = type_of(pc);
+    const Bitboard target = effects_from(pc, from, occ) & ~pieces(us);
+
+    Bitboard checks = target & ci.checkSq[pt];
+    if (!(pt & PIECE_PROMOTE) && pt != GOLD)
+      checks |= (canPromote(us, from) ? target : target & enemy_field(us)) & ci.checkSq[pt + PIECE_PROMOTE];
+
+    // 開き王手の候補なら、相手玉との直線から外れる移動はすべて王手になる。
+    if (ci.dcCandidates & from)
+      checks |= target & ~line_bb(ksq, from);
+
+    while (checks)
+      if (!discovered(from, checks.pop(), our_ksq, ci.pinned))
+        return true;
+  }
+
+  // 3) 玉の移動による開き王手。
+  if (our_ksq != SQ_NB && (ci.dcCandidates & our_ksq))
+  {
+    Bitboard target = kingEffect(our_ksq) & ~pieces(us) & ~line_bb(ksq, our_ksq);
+    while (target)
+      if (!effected_to(them, target.pop()))
+        return true;
+  }
+  return false;
+}
+
 // ----------------------------------
 //      指し手の合法性のテスト
 // ----------------------------------
@@ -706,7 +862,8 @@ bool Position::pseudo_legal(const Move m) const {
 // ----------------------------------
 
 // 指し手で盤面を1手進める。
-void Position::do_move(Move m, StateInfo& new_st, bool givesCheck)
+template <bool KnownCheckers>
+void Position::do_move_impl(Move m, StateInfo& new_st, bool givesCheck, const Bitboard& checkersBB)
 {
   // 現在の局面のhash keyはこれで、これを更新していき、次の局面のhash keyを求めてStateInfo::key_に格納。
   auto k = st->key_board_ ^ Zobrist::side;
@@ -750,14 +907,21 @@ void Position::do_move(Move m, StateInfo& new_st, bool givesCheck)
 
     Piece pc = make_piece(pr, Us);
     PieceNo piece_no = piece_no_of(Us, pr);
+#ifdef MATE_1PLY
+    // toを通過していた長い利きを遮る。
+    update_long_effect(to, -1);
+#endif
     put_piece(to, pc , piece_no);
+#ifdef MATE_1PLY
+    update_effect(pc, to, +1);
+#endif
 
     // 駒打ちなので手駒が減る
     sub_hand(hand[Us], pr);
 
     // 王手している駒のbitboardを更新する。
     // 駒打ちなのでこの駒で王手になったに違いない。駒打ちで両王手はありえないので王手している駒はいまtoに置いた駒のみ。
-    st->checkersBB = givesCheck ? Bitboard(to) : ZERO_BB;
+    st->checkersBB = KnownCheckers ? checkersBB : givesCheck ? Bitboard(to) : ZERO_BB;
 
     // 駒打ちは捕獲した駒がない。
     st->capturedType = NO_PIECE;
@@ -780,6 +944,17 @@ void Position::do_move(Move m, StateInfo& new_st, bool givesCheck)
 
     // 移動先の升にある駒
     Piece to_pc = piece_on(to);
+
+#ifdef MATE_1PLY
+    // 利きの更新(1) 盤面を更新する前に、移動させる駒と捕獲される駒の利きを取り除き、
+    // toが空いていたならtoを通過していた長い利きを遮る。
+    update_effect(moved_pc, from, -1);
+    if (to_pc != NO_PIECE)
+      update_effect(to_pc, to, -1);
+    else
+      update_long_effect(to, -1);
+#endif
+
     if (to_pc != NO_PIECE)
     {
       // --- capture(駒の捕獲)
@@ -832,12 +1007,20 @@ void Position::do_move(Move m, StateInfo& new_st, bool givesCheck)
 
     put_piece(to, pc,piece_no);
 
+#ifdef MATE_1PLY
+    // 利きの更新(2) 盤面を更新したあとで、fromを通過していた長い利きを延ばし、移動先の駒の利きを足す。
+    update_long_effect(from, +1);
+    update_effect(pc, to, +1);
+#endif
+
     // fromにあったmoved_pcがtoにpcとして移動した。
     k -= Zobrist::psq[from][moved_pc];
     k += Zobrist::psq[to][pc];
 
     // 王手している駒のbitboardを更新する。
-    if (givesCheck)
+    if (KnownCheckers)
+      st->checkersBB = checkersBB;
+    else if (givesCheck)
     {
       ASSERT_LV1(is_ok(st->previous->checkInfo.ksq)); // CheckInfoが初期化されていないときはこれが変な値になっているかも。
       const CheckInfo& ci = st->previous->checkInfo;
@@ -891,8 +1074,13 @@ void Position::do_move(Move m, StateInfo& new_st, bool givesCheck)
   ++nodes;
   ++gamePly; // 厳密には、これはrootからの手数ではなく、初期盤面からの手数ではあるが。
 
+  // 渡された王手している駒が正しいかをテストするためのassert
+  ASSERT_LV3(!KnownCheckers || st->checkersBB == attackers_to(~sideToMove, king_square(sideToMove)));
 }
 
+template void Position::do_move_impl<false>(Move m, StateInfo& new_st, bool givesCheck, const Bitboard& checkersBB);
+template void Position::do_move_impl<true >(Move m, StateInfo& new_st, bool givesCheck, const Bitboard& checkersBB);
+
 // 指し手で盤面を1手戻す。do_move()の逆変換。
 void Position::undo_move(Move m)
 {
@@ -915,9 +1103,17 @@ void Position::undo_move(Move m)
     evalList.put_piece(piece_no, sideToMove, pt, hand_count(hand[sideToMove], pt));
     add_hand(hand[sideToMove], pt);
 
+#ifdef MATE_1PLY
+    update_effect(to_pc, to, -1);
+#endif
+
     // toの場所から駒を消す
     remove_piece(to);
 
+#ifdef MATE_1PLY
+    update_long_effect(to, +1);
+#endif
+
   } else {
 
     // --- 通常の指し手
@@ -925,8 +1121,15 @@ void Position::undo_move(Move m)
     auto from = move_from(m);
     ASSERT_LV2(is_ok(from));
 
+#ifdef MATE_1PLY
+    // 利きはdo_move()と逆の順番で戻す。
+    update_effect(to_pc, to, -1);
+    update_long_effect(from, -1);
+#endif
+
     // 成りの指し手だったなら非成りの駒がfromの場所に戻る。さもなくばそのまま戻る。
-    put_piece(from, is_promote(m) ? (to_pc - PIECE_PROMOTE) : to_pc,piece_no);
+    const Piece moved_pc = is_promote(m) ? (to_pc - PIECE_PROMOTE) : to_pc;
+    put_piece(from, moved_pc, piece_no);
 
     // toの場所から駒を消す
     remove_piece(to);
@@ -943,6 +1146,14 @@ void Position::undo_move(Move m)
       // 手駒から減らす
       sub_hand(hand[sideToMove], raw_type_of(st->capturedType));
     }
+
+#ifdef MATE_1PLY
+    if (st->capturedType != NO_PIECE)
+      update_effect(make_piece(st->capturedType, ~sideToMove), to, +1);
+    else
+      update_long_effect(to, +1);
+    update_effect(moved_pc, from, +1);
+#endif
   }
 
   // --- StateInfoを巻き戻す
@@ -1006,5 +1217,11 @@ bool Position::pos_is_ok() const
   if ((pieces() != (pieces(BLACK) | pieces(WHITE))) || (pieces(BLACK) & pieces(WHITE)))
     return false;
 
+#ifdef MATE_1PLY
+  // 6) 差分更新している利きは合っているか
+  if (!effect_is_ok())
+    return false;
+#endif
+
   return true;
 }
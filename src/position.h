@@ -111,6 +111,44 @@ struct StateInfo {
   StateInfo* previous;
 };
 
+#ifdef MATE_1PLY
+// --------------------
+//       利き
+// --------------------
+
+// 方角を表すbit。長い利きの方向や、玉から見た方角を表すのに用いる。(Square型の差分値の小さい順)
+// bit0..右上、bit1..右、bit2..右下、bit3..上、bit4..下、bit5..左上、bit6..左、bit7..左下
+enum Directions : uint8_t {
+  DIRECTIONS_RU = 1 , DIRECTIONS_R = 2  , DIRECTIONS_RD = 4  , DIRECTIONS_U  = 8 ,
+  DIRECTIONS_D = 16 , DIRECTIONS_LU = 32 , DIRECTIONS_L = 64 , DIRECTIONS_LD = 128 };
+
+// 利きの数や遠方駒の利きの方向を表現するByteBoard
+// Positionが先後別に持ち、do_move()/undo_move()で差分更新する。(extra/mate1ply.cpp)
+struct ByteBoard
+{
+  // ある升の利きの数
+  uint8_t count(Square sq) const { return e[sq]; }
+
+  // ある升を通過している長い利きの方向
+  Directions directions(Square sq) const { return (Directions)e[sq]; }
+
+  // ゼロクリア
+  void clear() { std::memset(e, 0, sizeof(e)); }
+
+  // ある升の周辺8近傍の利きを取得。1以上の値のところが1になる。盤外は0になる。(bitの並びはDirectionsと同じ)
+  uint8_t around8(Square sq) const;
+
+  // ある升の周辺8近傍の利きを取得。2以上の値のところが1になる。盤外は0になる。
+  uint8_t around8_larger_than_one(Square sq) const;
+
+  // [SQ_NB]は盤外を表す。ここは常に0。
+  uint8_t e[SQ_NB_PLUS1];
+};
+
+// 1手詰め判定のテーブルなどの初期化。(extra/mate1ply.cpp)
+namespace Mate1Ply { void init(); }
+#endif
+
 // --------------------
 //       盤面
 // --------------------
@@ -204,7 +242,11 @@ struct Position
   // このバッファはこのdo_move()の呼び出し元の責任において確保されている必要がある。
   // givesCheck = mの指し手によって王手になるかどうか。
   // この呼出までにst.checkInfo.update(pos)が呼び出されている必要がある。
-  void do_move(Move m,StateInfo& st, bool givesCheck);
+  void do_move(Move m, StateInfo& st, bool givesCheck) { do_move_impl<false>(m, st, givesCheck, ZERO_BB); }
+
+  // 指し手mで王手している駒checkersBBがわかっているときは、それを渡せばdo_move()のなかで求めなおさない。
+  // (LEGAL_CHECKS,LEGAL_CHECKS_ALLで生成した指し手なら、checkers_of()で取り出せる)
+  void do_move(Move m, StateInfo& st, const Bitboard& checkersBB) { do_move_impl<true>(m, st, true, checkersBB); }
 
   // do_move()の4パラメーター版のほうを呼び出すにはgivesCheckも渡さないといけないが、
   // mで王手になるかどうかがわからないときはこちらの関数を用いる。都度CheckInfoのコンストラクタが呼び出されるので遅い。探索中には使わないこと。
@@ -317,15 +359,35 @@ struct Position
   // 現局面で指し手がないかをテストする。指し手生成ルーチンを用いるので速くない。探索中には使わないこと。
   bool is_mated() const;
 
+  // 王手をかけられている手番側に、王手を回避する合法手があるか。MoveList<LEGAL>(pos).size() != 0 と同じ結果になる。
+  // 指し手生成をせずに1手見つけた時点で返すので、探索中の詰み判定に使える。
+  // 注意 : 王手がかかっていること。
+  bool has_legal_evasion() const;
+
+  // 手番側に、相手玉に王手をかける合法手があるか。MoveList<LEGAL_ALL>にgives_check()である指し手があるかと同じ結果になる。
+  // (王手がかかっているときを除いて)指し手生成をせずに1手見つけた時点で返す。
+  // 注意 : 事前にcheck_info_update()が呼び出されていること。
+  bool has_legal_check() const;
+
   // --- 超高速1手詰め判定
 #ifdef  MATE_1PLY
   // 現局面で1手詰めであるかを判定する。1手詰めであればその指し手を返す。
-  // ただし1手詰めであれば確実に詰ませられるわけではなく、簡単に判定できそうな近接王手による
-  // 1手詰めのみを判定する。(要するに判定に漏れがある。)
+  // ただし、簡単に判定できそうな近接王手(桂の王手を含む)による1手詰めのみを判定する。(要するに判定に漏れがある。)
+  // 返した指し手は合法手であり、確実に詰ませられる。手番側に王手がかかっているときはMOVE_NONEを返す。
+  // 注意 : 事前にcheck_info_update()が呼び出されていること。(pinされている駒を用いるので)
   Move mate1ply() const;
 
   // ↑の先後別のバージョン。(内部的に用いる)
   template <Color Us> Move mate1ply_impl() const;
+
+  // c側の各升の利きの数
+  const ByteBoard& board_effect(Color c) const { return effect[c]; }
+
+  // c側の長い利きが、各升をどの方向に通過しているか
+  const ByteBoard& long_effect_of(Color c) const { return long_effect[c]; }
+
+  // 差分更新している利きが、初めから計算し直したものと一致するか。(デバッグ用)
+  bool effect_is_ok() const;
 #endif
 
   // --- デバッグ用の出力
@@ -346,6 +408,10 @@ struct Position
 
 protected:
 
+  // do_move()の本体。KnownCheckersなら王手している駒としてcheckersBBをそのまま用いる。
+  template <bool KnownCheckers>
+  void do_move_impl(Move m, StateInfo& st, bool givesCheck, const Bitboard& checkersBB);
+
   // 盤面、81升分の駒。
   Piece board[SQ_NB];
 
@@ -387,6 +453,26 @@ protected:
   // sqの地点にpcを置く/取り除く、したとして内部で保持しているBitboardを更新する。
   void xor_piece(Piece pc, Square sq);
 
+#ifdef MATE_1PLY
+  // --- 利き
+
+  // 先手/後手の各升の利きの数
+  ByteBoard effect[COLOR_NB];
+
+  // 先手/後手の長い利きが各升をどの方向に通過しているか(その升で止まっているものも含む)
+  ByteBoard long_effect[COLOR_NB];
+
+  // sqに置かれた駒pcの利きを、s == +1なら足し、s == -1なら引く。
+  // 長い利きは現在の盤面で駒にぶつかるまで。
+  void update_effect(Piece pc, Square sq, int s);
+
+  // sqの升が空いた(s == +1)/埋まった(s == -1)ときに、sqを通過している長い利きのsqより先の部分を足す/引く。
+  void update_long_effect(Square sq, int s);
+
+  // 盤面から利きを計算し直す。
+  void set_effect();
+#endif
+
   // --- 盤面を更新するときにEvalListの更新のために必要なヘルパー関数
 
   // c側の手駒ptの最後の1枚のBonaPiece番号を返す
@@ -408,6 +494,23 @@ protected:
   void set_state(StateInfo* si) const;
 };
 
+// LEGAL_CHECKS,LEGAL_CHECKS_ALLで生成した指し手は、ExtMove::checkersに王手している駒が記録されている。
+// bit0..6 = 開き王手をしている駒の升(開き王手でなければSQ_NB)、bit7 = 動かした(打った)駒による直接王手か。
+// direct == falseかつdiscovered == SQ_NBなら王手ではない。
+inline uint16_t make_checkers(bool direct, Square discovered) { return (uint16_t)(discovered | (direct << 7)); }
+
+// make_checkers()の形式で記録した王手している駒を取り出す。do_move()に渡せる。
+inline Bitboard checkers_of(const ExtMove& e)
+{
+  const Square dc = (Square)(e.checkers & 0x7f);
+  const Bitboard b = (e.checkers & 0x80) ? Bitboard(move_to(e.move)) : ZERO_BB;
+  return dc != SQ_NB ? (b | dc) : b;
+}
+
+// 指し手mで王手している駒をmake_checkers()の形式で求める。置換表の指し手など、生成していない指し手用。
+// gives_check()とdo_move()での王手している駒の求め方と同じ。事前にcheck_info_update()が呼び出されていること。
+uint16_t make_checkers(const Position& pos, Move m);
+
 // PieceからPieceTypeBitboardへの変換テーブル
 const PieceTypeBitboard piece2ptb[PIECE_WHITE] = {
   PIECE_TYPE_BITBOARD_NB /*NO_PIECE*/,PIECE_TYPE_BITBOARD_PAWN /*歩*/,PIECE_TYPE_BITBOARD_LANCE /*香*/,PIECE_TYPE_BITBOARD_KNIGHT /*桂*/,
@@ -470,4 +573,8 @@ std::ostream& operator<<(std::ostream& os, const Position& pos);
 // depthに応じたZobrist Hashを得る。depthを含めてhash keyを求めたいときに用いる。
 HASH_KEY DepthHash(int depth);
 
+// c側の手駒がhであるときの手駒のZobrist Hashを得る。
+// long_key()からこれを引くと、c側の手駒を含まないhash keyになる。(優等局面を調べる置換表で用いる)
+HASH_KEY HandHash(Color c, Hand h);
+
 #endif // of #ifndef _SHOGI_H_
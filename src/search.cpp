@@ -23,15 +23,44 @@ using namespace Search;
 // 協力詰めsolverの場合
 #ifdef COOPERATIVE_MATE_SOLVER
 void Search::init() {}
-void Search::clear() { CooperativeMate::TT.clear(); }
+void Search::clear() {
+  CooperativeMate::TT.prepare();
+  if (!CooperativeMate::TT.persistent())
+    CooperativeMate::clear_hash();
+  sync_cout << "info string " << CooperativeMate::TT.info() << sync_endl;
+}
 void MainThread::think() {
-  CooperativeMate::init();
+  // 置換表のクリアは探索スレッドで分担する。(first-touchで置換表のメモリを各スレッドのNUMA nodeに置くため)
+  if (CooperativeMate::clearing_hash)
+  {
+    for (auto th : Threads.slaves) th->search_start();
+    CooperativeMate::clear_hash_slice(thread_id());
+    for (auto th : Threads.slaves) th->join();
+    return;
+  }
+
+  CooperativeMate::init(rootPos);
   for (auto th : Threads.slaves) th->search_start();
   search();
   for (auto th : Threads.slaves) th->join();
+
+  // 別解を列挙するなら、同じスレッドたちでもう一度探索する。
+  if (CooperativeMate::start_enumeration(rootPos))
+  {
+    for (auto th : Threads.slaves) th->search_start();
+    search();
+    for (auto th : Threads.slaves) th->join();
+  }
   CooperativeMate::finalize();
 }
-void Thread::search() { CooperativeMate::id_loop(rootPos, (int)thread_id(), (int)Options["Threads"]); }
+void Thread::search() {
+  if (CooperativeMate::clearing_hash)
+    CooperativeMate::clear_hash_slice(thread_id());
+  else if (CooperativeMate::enumerating)
+    CooperativeMate::enumerate(rootPos);
+  else
+    CooperativeMate::id_loop(rootPos, (int)thread_id(), (int)Options["Threads"]);
+}
 #else
 
 // 起動時に呼び出される。時間のかからない探索関係の初期化処理はここに書くこと。
@@ -96,6 +96,9 @@ int main(int argc, char* argv[])
   USI::init(Options);
   Bitboards::init();
   Position::init();
+#ifdef MATE_1PLY
+  Mate1Ply::init();
+#endif
   Search::init();
   Threads.init();
   Eval::init(); // 簡単な初期化のみで評価関数の読み込みはisreadyに応じて行なう。
@@ -77,6 +77,10 @@
 // 協力詰めの最長は49909。「寿限無3」 cf. http://www.ne.jp/asahi/tetsu/toybox/kato/fbaka4.htm
 #define COOPERATIVE_MATE_SOLVER
 
+// 協力詰めsolverの置換表で、先手の手駒だけが異なる局面の探索結果を使う(優等局面の判定をする)。
+// 駒打ちの多い問題では枝刈りが増えるが、1つのClusterに入るentryの数は減る。(BucketClusterの7に対してHandClusterは4)
+//#define CM_HAND_DOMINANCE
+
 // --------------------
 // release configurations
 // --------------------
@@ -91,7 +95,8 @@
 
 #ifdef COOPERATIVE_MATE_SOLVER
 #undef ASSERT_LV
-#define KEEP_LAST_MOVE
+// 詰み手順は置換表から復元するのでStateInfoに直前の指し手を保存しておく必要はない。
+#undef KEEP_LAST_MOVE
 #undef  MAX_PLY_
 #define MAX_PLY_ 65000
 #undef HASH_KEY_BITS
@@ -243,6 +248,23 @@ inline int32_t POPCNT64(uint64_t a) {
 }
 #endif
 
+// 64bit×64bit → 128bitの乗算の上位64bitを返す。
+// 置換表のindexの計算などで、剰余(%)の代わりに[0,n)の範囲に写像するのに用いる。
+// mul_hi64(key, n) は keyが一様に分布していれば [0,n) に一様に分布する。
+#if defined(_MSC_VER) && defined(_WIN64)
+#include <intrin.h>
+inline uint64_t mul_hi64(uint64_t a, uint64_t b) { return __umulh(a, b); }
+#elif defined(__GNUC__) && defined(__x86_64__)
+inline uint64_t mul_hi64(uint64_t a, uint64_t b) { return (uint64_t)(((unsigned __int128)a * b) >> 64); }
+#else
+inline uint64_t mul_hi64(uint64_t a, uint64_t b)
+{
+  const uint64_t a_lo = (uint32_t)a, a_hi = a >> 32, b_lo = (uint32_t)b, b_hi = b >> 32;
+  const uint64_t t = a_hi * b_lo + ((a_lo * b_lo) >> 32);
+  return a_hi * b_hi + (t >> 32) + ((a_lo * b_hi + (uint32_t)t) >> 32);
+}
+#endif
+
 // --------------------
 //      手番
 // --------------------
@@ -638,6 +660,7 @@ std::ostream& operator<<(std::ostream& os, Move m);
 struct ExtMove {
 
   Move move;   // 指し手
+  uint16_t checkers; // LEGAL_CHECKS,LEGAL_CHECKS_ALLで生成した指し手の王手している駒。(make_checkers()の形式。それ以外の指し手生成では不定)
   Value value; // これはMovePickerが指し手オーダリングのために並び替えるときに用いる値(≠評価値)。
 
   // Move型とは暗黙で変換できていい。
@@ -736,7 +759,8 @@ const int MAX_MOVES = 600;
 // 生成する指し手の種類
 enum MOVE_GEN_TYPE
 {
-  // LEGAL/LEGAL_ALL以外は自殺手が含まれることがある(pseudo-legal)ので、do_moveの前にPosition::legal()でのチェックが必要。
+  // LEGAL,LEGAL_EVASIONS,LEGAL_CHECKS(と、それぞれの_ALL)以外は自殺手が含まれることがある(pseudo-legal)ので、
+  // do_moveの前にPosition::legal()でのチェックが必要。
 
   NON_CAPTURES,	// 駒を取らない指し手
   CAPTURES,			// 駒を取る指し手
@@ -763,6 +787,17 @@ enum MOVE_GEN_TYPE
   // 以下の2つは、やねうら王nanoでは削除予定
   CHECKS,               // 王手となる指し手(歩の不成などは含まない)
   CHECKS_ALL,           // 王手となる指し手(歩の不成なども含む)
+
+  // 以下の2つは、王手されている局面での合法な回避手。pinされている駒の移動と、相手の利きのある升への玉の移動を
+  // 生成時にbitboardで除外するので、pos.legal()でのチェックは不要。
+  LEGAL_EVASIONS,       // EVASIONSから自殺手を除いたもの
+  LEGAL_EVASIONS_ALL,   // EVASIONS_ALLから自殺手を除いたもの
+
+  // 以下の2つは、合法な王手。pinされている駒と玉の移動先を生成時に絞るので、pos.legal()でのチェックは不要。
+  // また、ExtMove::checkersに王手している駒を記録する。(checkers_of()で取り出してdo_move()に渡せる)
+  // 事前にpos.check_info_update()が呼び出されていること。
+  LEGAL_CHECKS,         // CHECKSから自殺手を除いたもの
+  LEGAL_CHECKS_ALL,     // CHECKS_ALLから自殺手を除いたもの
 };
 
 struct Position; // 前方宣言
@@ -775,6 +810,12 @@ struct CheckInfo;
 template <MOVE_GEN_TYPE gen_type>
 ExtMove* generateMoves(const Position& pos, ExtMove* mlist);
 
+// 指し手を生成せずに、その数だけを返す。MoveList<gen_type>(pos).size()と同じ値になるが、
+// 移動先のbitboardのpopcountで数えてバッファへの書き出しをしないので、指し手の多い局面ほど速い。
+// NON_EVASIONS,EVASIONS(_ALL),LEGAL_EVASIONS(_ALL),NON_CAPTURES_PRO_MINUS,CAPTURES_PRO_PLUSに対応。
+template <MOVE_GEN_TYPE gen_type>
+int countMoves(const Position& pos);
+
 // MoveGeneratorのwrapper。範囲forで回すときに便利。
 template<MOVE_GEN_TYPE GenType>
 struct MoveList {
@@ -905,6 +946,10 @@ namespace USI {
     Option(int v, int min_, int max_, OnChange f = nullptr) : type("spin"),min(min_),max(max_),on_change(f)
     {  defaultValue = currentValue = std::to_string(v); }
 
+    // 文字列型のoption デフォルト値が v
+    Option(const char* v, OnChange f = nullptr) : type("string"), min(0), max(0), on_change(f)
+    {  defaultValue = currentValue = v; }
+
     // USIプロトコル経由で値を設定されたときにそれをcurrentValueに反映させる。
     Option& operator=(const std::string&);
 
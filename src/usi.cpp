@@ -66,6 +66,50 @@ namespace USI
     // 協力詰めsolver
 #ifdef    COOPERATIVE_MATE_SOLVER
     o["CM_Hash"] << Option(16, 1, MaxHashMB, [](auto&o) { CooperativeMate::TT.resize(o); });
+
+    // 協力詰め用の置換表をNUMA nodeをまたいでinterleaveして配置する。
+    // falseならば、isreadyのときに探索スレッドと同じ数のスレッドで置換表をクリアして各nodeに分散させる。
+    o["CM_HashInterleave"] << Option(false, [](auto&o) { CooperativeMate::TT.set_numa_interleave(o); });
+
+    // 協力詰め用の置換表をこのファイルにmemory mapして置く。空(<empty>)ならファイルには置かない。
+    // ファイルに置いた置換表は、isreadyでクリアされず、エンジンを再起動してもその中身を引き継ぐ。
+    o["CM_HashFile"] << Option("", [](auto&o) { CooperativeMate::TT.set_hash_file(o); });
+
+    // 協力詰め用の置換表をクリアする。(CM_HashFileに置いた置換表の中身を捨てたいとき用)
+    o["CM_ClearHash"] << Option([](auto&) { CooperativeMate::clear_hash(); });
+
+    // 探索の途中経過(checkpoint)をCM_CheckpointInterval秒ごとにこのファイルに書き出す。空(<empty>)なら書き出さない。
+    // "go mate resume <file>"でそこから探索を再開できる。置換表はCM_HashFileに置いておけば再開時に引き継がれる。
+    o["CM_Checkpoint"] << Option("");
+    o["CM_CheckpointInterval"] << Option(600, 1, 24 * 60 * 60);
+
+    // 最短手数の解を見つけたあと、同じ手数の別解(余詰め)を列挙する数。
+    // 1なら最初の解を見つけた時点で終了する。0なら全部列挙して数だけ出力する。
+    // 2以上ならその数まで"info string solution"で出力する。
+    o["CM_Solutions"] << Option(1, 0, INT32_MAX);
+
+    // 並列探索をlazy SMP(スレッドごとに異なる深さを探索する)ではなく、work stealingで行なう。
+    // 全スレッドが同じ深さを探索し、探索開始局面からCM_SplitPly手までの局面を分担する。
+    o["CM_WorkStealing"] << Option(false);
+    o["CM_SplitPly"] << Option(6, 1, 32);
+
+    // 複数スレッドで探索するときに、他のスレッドが探索中の局面を後回しにする。(ABDADA)
+    o["CM_ABDADA"] << Option(true);
+
+    // 置換表の使用率(hashfullの値、‰)がこれに達したら探索を打ち切る。0なら打ち切らない。
+    o["CM_HashfullLimit"] << Option(0, 0, 1000);
+
+    // 残り探索深さがこれ以上の局面では、王手や応手を詰みやすそうな順に並べ替えてから調べる。0なら並べ替えない。
+    // 効果は問題によるので、"test cmorder"で問題集に対して測ってから設定すること。
+    o["CM_OrderDepth"] << Option(0, 0, MAX_PLY);
+
+    // 残り探索深さがこれ以上の局面では、前の反復までに不詰めが確定しなかった指し手(history)と、
+    // 直前の指し手に対して生き残った指し手(counter move)を先に調べる。0なら使わない。"test cmhistory"で効果を測れる。
+    o["CM_HistoryDepth"] << Option(0, 0, MAX_PLY);
+
+    // 残り1手の局面の1手詰めと、王手をかけた局面の詰みを、指し手生成とdo_move()をなるべくせずにbitboardで判定する。
+    // "test cmleaf"で従来の判定と結果が一致することを確かめられる。
+    o["CM_LeafSolver"] << Option(true);
 #endif
 
     // cin/coutの入出力をファイルにリダイレクトする
@@ -86,8 +130,9 @@ namespace USI
 
     // ボタン型は値を設定するものではなく、単なるトリガーボタン。
     // ボタン型以外なら入力値をcurrentValueに反映させてやる。
+    // 文字列型で空の文字列を設定するときはUSIプロトコルでは"<empty>"が送られてくる。
     if (type != "button")
-      currentValue = v;
+      currentValue = (type == "string" && v == "<empty>") ? "" : v;
 
     // 値が変化したのでハンドラを呼びだす。
     if (on_change)
@@ -106,7 +151,7 @@ namespace USI
           const Option& o = it.second;
           os << "option name " << it.first << " type " << o.type;
           if (o.type != "button")
-            os << " default " << o.defaultValue;
+            os << " default " << ((o.type == "string" && o.defaultValue.empty()) ? "<empty>" : o.defaultValue);
           if (o.type == "spin")
             os << " min " << o.min << " max " << o.max;
           os << endl;
@@ -204,7 +249,7 @@ void setoption_cmd(istringstream& is)
 
 // go()は、思考エンジンがUSIコマンドの"go"を受け取ったときに呼び出される。
 // この関数は、入力文字列から思考時間とその他のパラメーターをセットし、探索を開始する。
-void go_cmd(const Position& pos, istringstream& is) {
+void go_cmd(Position& pos, istringstream& is) {
 
   Search::LimitsType limits;
   string token;
@@ -246,8 +291,29 @@ void go_cmd(const Position& pos, istringstream& is) {
       is >> token;
       if (token == "infinite")
         limits.mate = INT32_MAX;
+#ifdef COOPERATIVE_MATE_SOLVER
+      // "go mate resume <file>"ならcheckpointのファイルから探索局面と途中経過を読み込んで再開する。
+      else if (token == "resume")
+      {
+        string path, sfen;
+        getline(is >> ws, path);
+        if (!CooperativeMate::load_checkpoint(path, sfen))
+        {
+          sync_cout << "info string failed to read checkpoint " << path << sync_endl;
+          return;
+        }
+        pos.set(sfen);
+        SetupStates = Search::StateStackPtr(new std::stack<StateInfo>);
+        limits.mate = INT32_MAX;
+      }
+#endif
       else
-        is >> limits.mate;
+      {
+        // 数値でなければ(あるいは省略されていれば)既定値のままにしておく。
+        int mate;
+        if (istringstream(token) >> mate)
+          limits.mate = mate;
+      }
     }
 
     // 時間無制限。
@@ -336,6 +402,11 @@ void USI::loop()
     // この局面のhash keyの値を出力
     else if (token == "key") cout << hex << pos.state()->key() << dec << endl;
 
+#ifdef COOPERATIVE_MATE_SOLVER
+    // sfenのファイルの問題をまとめて解く
+    else if (token == "cmbatch") CooperativeMate::batch(is);
+#endif
+
 #ifdef ENABLE_TEST_CMD
     // パフォーマンステスト(Stockfishにある、合法手N手で到達できる局面を求めるやつ)
     else if (token == "perft") perft(pos, is);